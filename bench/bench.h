@@ -0,0 +1,25 @@
+// Descrizione di un kernel del benchmark di runtime (bench/runtime.py).
+// Ogni file in bench/kernels definisce la funzione f su cui gira il passo e un BENCH_KERNEL che dice
+// a runtime_main.c quanti array allocare, di che tipo e forma, e come chiamare f.
+#ifndef LOOP_FUSE_BENCH_H
+#define LOOP_FUSE_BENCH_H
+
+// forma degli array: n elementi, matrice n x n contigua, o n puntatori a righe di n elementi
+enum bench_shape { BENCH_1D, BENCH_2D, BENCH_ROWS };
+
+enum bench_type { BENCH_INT, BENCH_DOUBLE };
+
+struct bench_kernel {
+  const char *name;
+  int arrays;
+  enum bench_shape shape;
+  enum bench_type type;
+  void (*run)(void **arrays, int n);
+};
+
+extern const struct bench_kernel bench_kernel;
+
+#define BENCH_KERNEL(NAME, ARRAYS, SHAPE, TYPE, RUN) \
+  const struct bench_kernel bench_kernel = {NAME, ARRAYS, SHAPE, TYPE, RUN}
+
+#endif
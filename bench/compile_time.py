@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Time the loop-fuse pass on the synthetic functions of gen_loops.py and write a CSV row per
+configuration, to compare the compile time of two revisions of the pass.
+
+For each combination of loops, arrays, depth and shape the driver generates the IR, runs
+`opt -passes=loop-fuse` on it with -time-passes and -stats, and records the time spent in the
+pass, the peak memory of opt, and the counters of the pass. The counters are only available
+when opt is built with statistics (assertions or LLVM_FORCE_ENABLE_STATS): otherwise their
+columns are left empty.
+
+Es: bench/compile_time.py --loops 10,100,1000 --opt-arg=-load-pass-plugin=build/LoopFusePass.so
+"""
+
+import argparse
+import csv
+import itertools
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+STATISTICS = {
+    "fusion_attempts": "NumFusionAttempts",
+    "dependence_queries": "NumDependenceQueries",
+    "fused_loops": "NumFusedLoops",
+    "budget_stops": "NumBudgetStops",
+}
+
+COLUMNS = ["revision", "loops", "arrays", "depth", "shape", "pass_seconds", "opt_seconds", "peak_rss_kb"] + list(STATISTICS)
+
+
+def int_list(text):
+    return [int(x) for x in text.split(",") if x]
+
+
+def str_list(text):
+    return [x for x in text.split(",") if x]
+
+
+def revision():
+    try:
+        return subprocess.check_output(["git", "-C", HERE, "rev-parse", "--short", "HEAD"], text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def parse_report(text):
+    """Time of the pass and its counters, from the text or JSON reports of -time-passes and -stats."""
+    pass_seconds = ""
+    # JSON: "time.pass.LoopFusionPass.wall": 0.0015
+    match = re.search(r'"time\.pass\.LoopFusionPass\.wall"\s*:\s*([0-9.eE+-]+)', text)
+    if match:
+        pass_seconds = float(match.group(1))
+    else:
+        # text: user, system, user+system and wall time, each followed by its percentage; the
+        # columns that are zero for all the passes are left out, but the wall time is always the last one
+        match = re.search(r"^((?:\s*[0-9.]+\s+\(\s*[0-9.]+%\))+)\s+LoopFusionPass\s*$", text, re.M)
+        if match:
+            pass_seconds = float(re.findall(r"([0-9.]+)\s+\(", match.group(1))[-1])
+
+    counters = {}
+    for column, name in STATISTICS.items():
+        # JSON: "loop-fuse.NumFusedLoops": 3, text: 3 loop-fuse - Number of loops fused
+        match = re.search(r'"loop-fuse\.%s"\s*:\s*([0-9]+)' % name, text)
+        counters[column] = int(match.group(1)) if match else ""
+    return pass_seconds, counters
+
+
+def run(opt, opt_args, ir, report):
+    # opt appends to the info output file
+    if os.path.exists(report):
+        os.remove(report)
+    command = [opt] + opt_args + ["-passes=loop-fuse", "-disable-output", "-time-passes", "-stats", "-stats-json",
+                                  "-info-output-file=" + report, ir]
+    start = time.perf_counter()
+    process = subprocess.Popen(command, stderr=subprocess.PIPE, text=True)
+    _, status, usage = os.wait4(process.pid, 0)
+    seconds = time.perf_counter() - start
+    errors = process.stderr.read()
+    process.stderr.close()
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        sys.stderr.write(errors)
+        raise SystemExit("opt failed on %s" % ir)
+    # ru_maxrss is in kilobytes on Linux
+    return seconds, usage.ru_maxrss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--opt", default="opt", help="opt binary with the loop-fuse pass")
+    parser.add_argument("--opt-arg", action="append", default=[], help="extra argument for opt, can be repeated")
+    parser.add_argument("--loops", type=int_list, default=int_list("10,100,1000,10000"))
+    parser.add_argument("--arrays", type=int_list, default=int_list("2,8"))
+    parser.add_argument("--depth", type=int_list, default=int_list("1,2"))
+    parser.add_argument("--shapes", type=str_list, default=str_list("unguarded,guarded"))
+    parser.add_argument("--mismatch-every", type=int, default=0, help="passed to gen_loops.py")
+    parser.add_argument("--typed-pointers", action="store_true", help="passed to gen_loops.py, for LLVM 14 and older")
+    parser.add_argument("--repeat", type=int, default=1, help="runs of each configuration, the fastest one is kept")
+    parser.add_argument("--revision", default=revision(), help="label of the measured revision (default: git HEAD)")
+    parser.add_argument("-o", "--output", default=os.path.join(HERE, "compile_time.csv"))
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory(prefix="loop-fuse-bench-") as work, open(args.output, "w", newline="") as out:
+        writer = csv.DictWriter(out, fieldnames=COLUMNS)
+        writer.writeheader()
+        for loops, arrays, depth, shape in itertools.product(args.loops, args.arrays, args.depth, args.shapes):
+            ir = os.path.join(work, "kernel.ll")
+            report = os.path.join(work, "report.txt")
+            generate = [sys.executable, os.path.join(HERE, "gen_loops.py"), "--loops", str(loops), "--arrays", str(arrays),
+                        "--depth", str(depth), "--shape", shape, "--mismatch-every", str(args.mismatch_every), "-o", ir]
+            if args.typed_pointers:
+                generate.append("--typed-pointers")
+            subprocess.check_call(generate)
+
+            best = None
+            for _ in range(max(1, args.repeat)):
+                seconds, rss = run(args.opt, args.opt_arg, ir, report)
+                with open(report) as f:
+                    pass_seconds, counters = parse_report(f.read())
+                if best is None or seconds < best["opt_seconds"]:
+                    best = dict(counters, pass_seconds=pass_seconds, opt_seconds=round(seconds, 4), peak_rss_kb=rss)
+
+            row = dict(best, revision=args.revision, loops=loops, arrays=arrays, depth=depth, shape=shape)
+            writer.writerow(row)
+            out.flush()
+            print("%6d loops, %2d arrays, depth %d, %-9s: %8.3fs, %7d KB" % (loops, arrays, depth, shape, row["opt_seconds"], rss))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""Generate a synthetic LLVM IR function with many sibling loop nests, to measure
+how the compile time of the loop-fuse pass scales.
+
+Every nest has the same shape: DEPTH nested loops counting from 0 to the bound,
+and an innermost body that reads ARRAYS-1 arrays and writes one. Consecutive
+nests share arrays, so most pairs are legal and profitable to fuse. The nests
+are either unguarded for loops, exiting from their header, or rotated do-while
+loops behind an `if (bound > 0)` guard, as clang emits them at -O1 and above.
+"""
+
+import argparse
+import sys
+
+
+class Emitter:
+    def __init__(self, args):
+        self.args = args
+        self.lines = []
+        self.ptr = "i32*" if args.typed_pointers else "ptr"
+
+    def emit(self, line):
+        self.lines.append(line)
+
+    def label(self, name):
+        self.emit("%s:" % name)
+
+    def bound(self, k):
+        every = self.args.mismatch_every
+        return "%m" if every and k % every == every - 1 else "%n"
+
+    def body(self, k, indices, bound, exit_label):
+        """Innermost body of nest k: a[k] = a[k+1] + ... + a[k+ARRAYS-1], on the flattened index."""
+        a = self.args
+        index = indices[0]
+        for d, i in enumerate(indices[1:], 1):
+            self.emit("  %%r%d_%d = mul nsw i32 %s, %s" % (k, d, index, bound))
+            self.emit("  %%x%d_%d = add nsw i32 %%r%d_%d, %s" % (k, d, k, d, i))
+            index = "%%x%d_%d" % (k, d)
+        self.emit("  %%idx%d = sext i32 %s to i64" % (k, index))
+        total = a.total_arrays
+        value = None
+        for j in range(1, a.arrays):
+            array = (k + j) % total
+            self.emit("  %%p%d_%d = getelementptr inbounds i32, %s %%a%d, i64 %%idx%d" % (k, j, self.ptr, array, k))
+            self.emit("  %%v%d_%d = load i32, %s %%p%d_%d, align 4" % (k, j, self.ptr, k, j))
+            if value is None:
+                value = "%%v%d_%d" % (k, j)
+            else:
+                self.emit("  %%s%d_%d = add nsw i32 %s, %%v%d_%d" % (k, j, value, k, j))
+                value = "%%s%d_%d" % (k, j)
+        if value is None:
+            value = index
+        self.emit("  %%q%d = getelementptr inbounds i32, %s %%a%d, i64 %%idx%d" % (k, self.ptr, k % total, k))
+        self.emit("  store i32 %s, %s %%q%d, align 4" % (value, self.ptr, k))
+        self.emit("  br label %%%s" % exit_label)
+
+    def for_loop(self, k, d, entry, indices, done):
+        """Loop at depth d of nest k, entered from block entry; branches to done when it exits."""
+        bound = self.bound(k)
+        header, body, latch = ("h%d_%d" % (k, d), "b%d_%d" % (k, d), "l%d_%d" % (k, d))
+        # an outermost loop exits straight to the preheader of the next nest
+        exit = done if d == 0 else "e%d_%d" % (k, d)
+        i = "%%i%d_%d" % (k, d)
+        self.emit("  br label %%%s" % header)
+        self.label(header)
+        self.emit("  %s = phi i32 [ 0, %%%s ], [ %%inc%d_%d, %%%s ]" % (i, entry, k, d, latch))
+        self.emit("  %%c%d_%d = icmp slt i32 %s, %s" % (k, d, i, bound))
+        self.emit("  br i1 %%c%d_%d, label %%%s, label %%%s" % (k, d, body, exit))
+        self.label(body)
+        if d + 1 < self.args.depth:
+            self.loop(k, d + 1, body, indices + [i], latch)
+        else:
+            self.body(k, indices + [i], bound, latch)
+        self.label(latch)
+        self.emit("  %%inc%d_%d = add nsw i32 %s, 1" % (k, d, i))
+        self.emit("  br label %%%s" % header)
+        if exit != done:
+            self.label(exit)
+            self.emit("  br label %%%s" % done)
+
+    def guarded_loop(self, k, d, entry, indices, done):
+        """Rotated loop at depth d of nest k, behind a guard on its bound."""
+        bound = self.bound(k)
+        preheader, header, exit = ("ph%d_%d" % (k, d), "h%d_%d" % (k, d), "e%d_%d" % (k, d))
+        i = "%%i%d_%d" % (k, d)
+        self.emit("  %%g%d_%d = icmp sgt i32 %s, 0" % (k, d, bound))
+        self.emit("  br i1 %%g%d_%d, label %%%s, label %%%s" % (k, d, preheader, done))
+        self.label(preheader)
+        self.emit("  br label %%%s" % header)
+        self.label(header)
+        self.emit("  %s = phi i32 [ 0, %%%s ], [ %%inc%d_%d, %%%s ]" % (i, preheader, k, d, "l%d_%d" % (k, d)))
+        if d + 1 < self.args.depth:
+            self.loop(k, d + 1, header, indices + [i], "l%d_%d" % (k, d))
+        else:
+            self.body(k, indices + [i], bound, "l%d_%d" % (k, d))
+        self.label("l%d_%d" % (k, d))
+        self.emit("  %%inc%d_%d = add nsw i32 %s, 1" % (k, d, i))
+        self.emit("  %%c%d_%d = icmp slt i32 %%inc%d_%d, %s" % (k, d, k, d, bound))
+        self.emit("  br i1 %%c%d_%d, label %%%s, label %%%s" % (k, d, header, exit))
+        self.label(exit)
+        self.emit("  br label %%%s" % done)
+
+    def loop(self, k, d, entry, indices, done):
+        if self.guarded(k):
+            self.guarded_loop(k, d, entry, indices, done)
+        else:
+            self.for_loop(k, d, entry, indices, done)
+
+    def guarded(self, k):
+        shape = self.args.shape
+        return shape == "guarded" or (shape == "mixed" and k % 2 == 1)
+
+    def function(self):
+        a = self.args
+        params = ["%s noalias %%a%d" % (self.ptr, j) for j in range(a.total_arrays)] + ["i32 %n", "i32 %m"]
+        self.emit("define void @kernel(%s) {" % ", ".join(params))
+        self.label("entry")
+        self.emit("  br label %pre0")
+        for k in range(a.loops):
+            self.label("pre%d" % k)
+            self.loop(k, 0, "pre%d" % k, [], "pre%d" % (k + 1))
+        self.label("pre%d" % a.loops)
+        self.emit("  ret void")
+        self.emit("}")
+        return "\n".join(self.lines) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--loops", type=int, default=10, help="number of sibling loop nests")
+    parser.add_argument("--arrays", type=int, default=3, help="arrays accessed by each nest (one is written)")
+    parser.add_argument("--total-arrays", type=int, default=0, help="arrays of the function (default: arrays + 1)")
+    parser.add_argument("--depth", type=int, default=1, help="depth of each nest")
+    parser.add_argument("--shape", choices=["unguarded", "guarded", "mixed"], default="unguarded")
+    parser.add_argument("--mismatch-every", type=int, default=0,
+                        help="every K-th nest runs up to %%m instead of %%n, so it cannot be fused (0: never)")
+    parser.add_argument("--typed-pointers", action="store_true", help="emit i32* instead of ptr, for LLVM 14 and older")
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+    if args.loops < 1 or args.arrays < 1 or args.depth < 1:
+        parser.error("loops, arrays and depth must be positive")
+    args.total_arrays = max(args.total_arrays or args.arrays + 1, args.arrays)
+
+    ir = Emitter(args).function()
+    if args.output == "-":
+        sys.stdout.write(ir)
+    else:
+        with open(args.output, "w") as f:
+            f.write(ir)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,22 @@
+// Due nest 2-D su matrici contigue n x n che scorrono le righe nello stesso ordine
+#include "bench.h"
+
+void f(double *restrict a, double *restrict b, double *restrict c, int n) {
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      b[i * n + j] = 3.0 * a[i * n + j];
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      c[i * n + j] = b[i * n + j] + a[i * n + j];
+    }
+  }
+}
+
+static void run(void **v, int n) {
+  f(v[0], v[1], v[2], n);
+}
+
+BENCH_KERNEL("nest2d", 3, BENCH_2D, BENCH_DOUBLE, run);
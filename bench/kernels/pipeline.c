@@ -0,0 +1,31 @@
+// Pipeline di operazioni elemento per elemento con array temporanei,
+// come la scrive chi spezza un'espressione lunga in passate semplici
+#include "bench.h"
+
+void f(double *restrict x, double *restrict y, double *restrict t, double *restrict u, double *restrict z, int n) {
+  for (int i = 0; i < n; i++) {
+    t[i] = 2.0 * x[i] + y[i];
+  }
+
+  for (int i = 0; i < n; i++) {
+    u[i] = t[i] * t[i];
+  }
+
+  for (int i = 0; i < n; i++) {
+    t[i] = u[i] - x[i];
+  }
+
+  for (int i = 0; i < n; i++) {
+    z[i] = 0.5 * t[i] + u[i];
+  }
+
+  for (int i = 0; i < n; i++) {
+    y[i] = z[i] + y[i];
+  }
+}
+
+static void run(void **v, int n) {
+  f(v[0], v[1], v[2], v[3], v[4], n);
+}
+
+BENCH_KERNEL("pipeline", 5, BENCH_1D, BENCH_DOUBLE, run);
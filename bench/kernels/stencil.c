@@ -0,0 +1,23 @@
+// Stencil 1-D a tre punti seguito da due passate che usano il risultato,
+// anche nell'elemento precedente
+#include "bench.h"
+
+void f(double *restrict a, double *restrict b, double *restrict c, double *restrict d, int n) {
+  for (int i = 1; i < n - 1; i++) {
+    b[i] = 0.25 * (a[i - 1] + 2.0 * a[i] + a[i + 1]);
+  }
+
+  for (int i = 1; i < n - 1; i++) {
+    c[i] = b[i] - b[i - 1];
+  }
+
+  for (int i = 1; i < n - 1; i++) {
+    d[i] = c[i] * c[i] + b[i];
+  }
+}
+
+static void run(void **v, int n) {
+  f(v[0], v[1], v[2], v[3], n);
+}
+
+BENCH_KERNEL("stencil", 4, BENCH_1D, BENCH_DOUBLE, run);
@@ -0,0 +1,23 @@
+// test/test.c con i puntatori restrict: tre loop 1-D su int, ognuno legge quello che ha scritto il precedente.
+// Senza restrict a, b, c e d possono fare alias e i loop verrebbero fusi solo dietro controlli a runtime
+#include "bench.h"
+
+void f(int *restrict a, int *restrict b, int *restrict c, int *restrict d, int n) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i] + c[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    c[i] = a[i] + b[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    d[i] = a[i] + c[i];
+  }
+}
+
+static void run(void **v, int n) {
+  f(v[0], v[1], v[2], v[3], n);
+}
+
+BENCH_KERNEL("test", 4, BENCH_1D, BENCH_INT, run);
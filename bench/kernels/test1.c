@@ -0,0 +1,25 @@
+// test/test1.c con i puntatori restrict: due loop do-while su int
+#include "bench.h"
+
+void f(int *restrict a, int *restrict b, int *restrict c, int *restrict d, int n, int m) {
+
+  int i = 0;
+  int j = 0;
+
+  do{
+    a[i] = 0;
+    i++;
+  }while(i<n);
+
+
+  do{
+    b[j] = a[j];
+    j++;
+  }while(j<n);
+}
+
+static void run(void **v, int n) {
+  f(v[0], v[1], v[2], v[3], n, 0);
+}
+
+BENCH_KERNEL("test1", 4, BENCH_1D, BENCH_INT, run);
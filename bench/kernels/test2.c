@@ -0,0 +1,22 @@
+// test/test2.c su matrici int contigue n x n con i puntatori restrict: due nest 2-D.
+// Con le matrici per righe di test/test2.c i puntatori alle righe possono fare alias e i nest non verrebbero fusi
+#include "bench.h"
+
+void f(int *restrict a, int *restrict b, int *restrict c, int *restrict d, int n) {
+    for(int i=0; i<n; i++){
+        for(int j=0; j<n; j++){
+            a[i*n+j] = 1/b[i*n+j]*c[i*n+j];
+        }
+    }
+    for(int i=0; i<n; i++){
+        for(int j=0; j<n; j++){
+            d[i*n+j] = a[i*n+j]+c[i*n+j];
+        }
+    }
+}
+
+static void run(void **v, int n) {
+  f(v[0], v[1], v[2], v[3], n);
+}
+
+BENCH_KERNEL("test2", 4, BENCH_2D, BENCH_INT, run);
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Build every kernel of bench/kernels with and without the loop-fuse pass, run both versions on
+arrays larger than the last level cache, check that they compute the same arrays, and report the
+speedup of the fused version.
+
+Both versions go through the pipeline of the Makefile (clang -O0, mem2reg) and then -O3; the
+fused one runs loop-fuse right after mem2reg. The driver bench/runtime_main.c times the kernel
+and, where perf_event_open is allowed, counts its cycles and cache misses. The exit status is 1
+if the two versions of a kernel disagree, so the script can gate enabling the pass.
+
+Es: bench/runtime.py --opt-arg=-load-pass-plugin=build/LoopFusePass.so --kernels stencil,pipeline
+"""
+
+import argparse
+import csv
+import glob
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+COLUMNS = ["revision", "kernel", "n", "transformed", "unfused_seconds", "fused_seconds", "speedup", "unfused_cycles",
+           "fused_cycles", "unfused_cache_misses", "fused_cache_misses", "outputs_match"]
+
+
+def str_list(text):
+    return [x for x in text.split(",") if x]
+
+
+def revision():
+    try:
+        return subprocess.check_output(["git", "-C", HERE, "rev-parse", "--short", "HEAD"], text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def last_level_cache():
+    """Size in bytes of the largest data cache of cpu0, or None if sysfs does not tell."""
+    sizes = []
+    for index in glob.glob("/sys/devices/system/cpu/cpu0/cache/index*"):
+        try:
+            with open(os.path.join(index, "type")) as f:
+                if f.read().strip() == "Instruction":
+                    continue
+            with open(os.path.join(index, "size")) as f:
+                size = f.read().strip()
+        except OSError:
+            continue
+        match = re.match(r"([0-9]+)([KMG]?)", size)
+        if match:
+            sizes.append(int(match.group(1)) * {"": 1, "K": 1 << 10, "M": 1 << 20, "G": 1 << 30}[match.group(2)])
+    return max(sizes) if sizes else None
+
+
+def check_call(command):
+    try:
+        subprocess.check_call(command)
+    except subprocess.CalledProcessError:
+        raise SystemExit("failed: " + " ".join(command))
+
+
+def ir_text(path):
+    # the module name is the only difference between two prints of the same IR
+    with open(path) as f:
+        return [line for line in f if not line.startswith("; ModuleID")]
+
+
+def build(args, kernel, work, driver):
+    """Build the unfused and the fused binaries of a kernel; also tell whether loop-fuse changed the IR."""
+    name = os.path.splitext(os.path.basename(kernel))[0]
+    base = os.path.join(work, name)
+    check_call([args.clang, "-O0", "-Xclang", "-disable-O0-optnone", "-fno-discard-value-names", "-emit-llvm", "-c",
+                "-I", HERE] + args.cflag + [kernel, "-o", base + ".bc"])
+    check_call([args.opt, "-S", "-passes=mem2reg", base + ".bc", "-o", base + "_mem2reg.ll"])
+    check_call([args.opt] + args.opt_arg + ["-S", "-passes=loop-fuse", base + "_mem2reg.ll", "-o", base + "_fused.ll"])
+    transformed = ir_text(base + "_mem2reg.ll") != ir_text(base + "_fused.ll")
+
+    binaries = {}
+    for version, ir in (("unfused", base + "_mem2reg.ll"), ("fused", base + "_fused.ll")):
+        optimized = "%s_%s_O3.bc" % (base, version)
+        check_call([args.opt, "-passes=default<O3>", ir, "-o", optimized])
+        check_call([args.llc, "-O3", "-filetype=obj", "-relocation-model=pic", optimized, "-o", optimized + ".o"])
+        binaries[version] = "%s_%s" % (base, version)
+        check_call([args.clang] + args.cflag + [driver, optimized + ".o", "-o", binaries[version]])
+    return name, binaries, transformed
+
+
+def run(binary, array_bytes, repeat):
+    output = subprocess.check_output([binary, str(array_bytes), str(repeat)], text=True)
+    return dict(re.findall(r"(\w+)=(\S+)", output))
+
+
+def counter(value):
+    return "" if value == "-1" else int(value)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--opt", default="opt", help="opt binary with the loop-fuse pass")
+    parser.add_argument("--llc", default="llc")
+    parser.add_argument("--opt-arg", action="append", default=[], help="extra argument for opt -passes=loop-fuse, can be repeated")
+    parser.add_argument("--cflag", action="append", default=[], help="extra argument for clang (es: -march=native), can be repeated")
+    parser.add_argument("--kernels", type=str_list, help="kernels to run (default: all of bench/kernels)")
+    parser.add_argument("--array-bytes", type=int, help="minimum size of each array (default: twice the last level cache)")
+    parser.add_argument("--repeat", type=int, default=5, help="runs of each binary, the fastest one is kept")
+    parser.add_argument("--revision", default=revision(), help="label of the measured revision (default: git HEAD)")
+    parser.add_argument("-o", "--output", default=os.path.join(HERE, "runtime.csv"))
+    args = parser.parse_args()
+
+    kernels = sorted(glob.glob(os.path.join(HERE, "kernels", "*.c")))
+    if args.kernels:
+        kernels = [os.path.join(HERE, "kernels", k + ".c") for k in args.kernels]
+    array_bytes = args.array_bytes
+    if array_bytes is None:
+        llc = last_level_cache()
+        array_bytes = 2 * llc if llc else 64 << 20
+        print("arrays of at least %d MB (last level cache: %s)" % (array_bytes >> 20, "%d KB" % (llc >> 10) if llc else "unknown"))
+
+    mismatches = 0
+    with tempfile.TemporaryDirectory(prefix="loop-fuse-bench-") as work, open(args.output, "w", newline="") as out:
+        writer = csv.DictWriter(out, fieldnames=COLUMNS)
+        writer.writeheader()
+        driver = os.path.join(work, "runtime_main.o")
+        check_call([args.clang, "-O2", "-c", "-I", HERE] + args.cflag + [os.path.join(HERE, "runtime_main.c"), "-o", driver])
+
+        print("%-10s %10s %12s %12s %8s %14s %14s  %s" % ("kernel", "n", "unfused (s)", "fused (s)", "speedup",
+                                                         "unfused misses", "fused misses", "outputs"))
+        for kernel in kernels:
+            name, binaries, transformed = build(args, kernel, work, driver)
+            unfused = run(binaries["unfused"], array_bytes, args.repeat)
+            fused = run(binaries["fused"], array_bytes, args.repeat)
+            match = unfused["checksum"] == fused["checksum"]
+            mismatches += not match
+            speedup = float(unfused["seconds"]) / float(fused["seconds"]) if float(fused["seconds"]) > 0 else 0
+            row = {
+                "revision": args.revision, "kernel": name, "n": unfused["n"], "transformed": int(transformed),
+                "unfused_seconds": unfused["seconds"], "fused_seconds": fused["seconds"], "speedup": round(speedup, 3),
+                "unfused_cycles": counter(unfused["cycles"]), "fused_cycles": counter(fused["cycles"]),
+                "unfused_cache_misses": counter(unfused["cache_misses"]), "fused_cache_misses": counter(fused["cache_misses"]),
+                "outputs_match": int(match),
+            }
+            writer.writerow(row)
+            out.flush()
+            print("%-10s %10s %12s %12s %7.2fx %14s %14s  %s%s" % (
+                name, row["n"], row["unfused_seconds"], row["fused_seconds"], speedup, row["unfused_cache_misses"] or "-",
+                row["fused_cache_misses"] or "-", "same" if match else "DIFFERENT", "" if transformed else " (not fused)"))
+
+    if mismatches:
+        sys.stderr.write("%d kernels compute different arrays with loop-fuse\n" % mismatches)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,199 @@
+// Driver del benchmark di runtime: alloca gli array del kernel con almeno <byte> byte ciascuno,
+// li inizializza in modo deterministico, esegue il kernel <ripetizioni> volte e stampa tempo,
+// cicli e cache miss della ripetizione piu' veloce, piu' un checksum degli array finali.
+// Va compilato a parte dal kernel, cosi' l'ottimizzazione del driver non tocca il kernel.
+//
+// Uso: <binario> <byte per array> <ripetizioni>
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "bench.h"
+
+//file descriptor dei contatori di perf_event_open, -1 se non disponibili
+struct counters {
+  int cyclesFd;
+  int missesFd;
+};
+
+#ifdef __linux__
+static int openCounter(uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group == -1;
+  // contando solo lo user space basta perf_event_paranoid <= 2
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static struct counters openCounters(void) {
+  struct counters c;
+  c.cyclesFd = openCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+  c.missesFd = c.cyclesFd == -1 ? -1 : openCounter(PERF_COUNT_HW_CACHE_MISSES, c.cyclesFd);
+  return c;
+}
+
+static void startCounters(struct counters c) {
+  if (c.cyclesFd == -1)
+    return;
+  ioctl(c.cyclesFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(c.cyclesFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void stopCounters(struct counters c, long long *cycles, long long *misses) {
+  *cycles = *misses = -1;
+  if (c.cyclesFd == -1)
+    return;
+  ioctl(c.cyclesFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  uint64_t value;
+  if (read(c.cyclesFd, &value, sizeof(value)) == sizeof(value))
+    *cycles = value;
+  if (c.missesFd != -1 && read(c.missesFd, &value, sizeof(value)) == sizeof(value))
+    *misses = value;
+}
+#else
+static struct counters openCounters(void) {
+  struct counters c = {-1, -1};
+  return c;
+}
+
+static void startCounters(struct counters c) {
+}
+
+static void stopCounters(struct counters c, long long *cycles, long long *misses) {
+  *cycles = *misses = -1;
+}
+#endif
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t elementSize(void) {
+  return bench_kernel.type == BENCH_INT ? sizeof(int) : sizeof(double);
+}
+
+//valori piccoli e diversi da zero: test2 divide per i suoi elementi
+static void fill(void *data, size_t count, uint64_t seed) {
+  uint64_t x = seed * 0x9e3779b97f4a7c15ull + 1;
+  for (size_t i = 0; i < count; i++) {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    unsigned v = 1 + (x >> 33) % 64;
+    if (bench_kernel.type == BENCH_INT)
+      ((int *)data)[i] = v;
+    else
+      ((double *)data)[i] = v / 16.0;
+  }
+}
+
+static uint64_t hash(uint64_t h, const void *data, size_t bytes) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < bytes; i++)
+    h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+//una matrice per righe e' un array di n puntatori a righe di n elementi
+static void *allocate(int n) {
+  size_t bytes = elementSize();
+  if (bench_kernel.shape == BENCH_1D)
+    return calloc(n, bytes);
+  if (bench_kernel.shape == BENCH_2D)
+    return calloc((size_t)n * n, bytes);
+  void **rows = calloc(n, sizeof(void *));
+  for (int i = 0; i < n; i++)
+    rows[i] = calloc(n, bytes);
+  return rows;
+}
+
+static void initialize(void **arrays, int n) {
+  for (int k = 0; k < bench_kernel.arrays; k++) {
+    if (bench_kernel.shape == BENCH_1D)
+      fill(arrays[k], n, k);
+    else if (bench_kernel.shape == BENCH_2D)
+      fill(arrays[k], (size_t)n * n, k);
+    else
+      for (int i = 0; i < n; i++)
+        fill(((void **)arrays[k])[i], n, (uint64_t)k * n + i);
+  }
+}
+
+static uint64_t checksum(void **arrays, int n) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (int k = 0; k < bench_kernel.arrays; k++) {
+    if (bench_kernel.shape == BENCH_1D)
+      h = hash(h, arrays[k], n * elementSize());
+    else if (bench_kernel.shape == BENCH_2D)
+      h = hash(h, arrays[k], (size_t)n * n * elementSize());
+    else
+      for (int i = 0; i < n; i++)
+        h = hash(h, ((void **)arrays[k])[i], n * elementSize());
+  }
+  return h;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "uso: %s <byte per array> <ripetizioni>\n", argv[0]);
+    return 2;
+  }
+  double bytes = atof(argv[1]);
+  int repetitions = atoi(argv[2]);
+
+  //lato n tale che ogni array occupi almeno i byte richiesti
+  double elements = bytes / elementSize();
+  int n = bench_kernel.shape == BENCH_1D ? (int)elements : 1;
+  while (bench_kernel.shape != BENCH_1D && (double)n * n < elements)
+    n++;
+
+  void *arrays[16];
+  if (bench_kernel.arrays > 16) {
+    fprintf(stderr, "%s: troppi array\n", bench_kernel.name);
+    return 2;
+  }
+  for (int k = 0; k < bench_kernel.arrays; k++)
+    if (!(arrays[k] = allocate(n))) {
+      fprintf(stderr, "%s: memoria esaurita\n", bench_kernel.name);
+      return 1;
+    }
+
+  struct counters counters = openCounters();
+  double best = -1;
+  long long bestCycles = -1, bestMisses = -1;
+  for (int r = 0; r < repetitions; r++) {
+    // la reinizializzazione (non misurata) rende ogni ripetizione uguale
+    // e toglie dalla cache gran parte dei dati
+    initialize(arrays, n);
+    long long cycles, misses;
+    startCounters(counters);
+    double start = now();
+    bench_kernel.run(arrays, n);
+    double seconds = now() - start;
+    stopCounters(counters, &cycles, &misses);
+    if (best < 0 || seconds < best) {
+      best = seconds;
+      bestCycles = cycles;
+      bestMisses = misses;
+    }
+  }
+
+  printf("kernel=%s n=%d seconds=%.9f cycles=%lld cache_misses=%lld checksum=%016llx\n", bench_kernel.name, n, best,
+         bestCycles, bestMisses, (unsigned long long)checksum(arrays, n));
+  return 0;
+}
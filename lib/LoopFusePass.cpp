@@ -1,153 +1,611 @@
-#include "llvm/Transforms/Utils/LoopFusePass.h" // FUNCTION_PASS("loop-fuse", LoopFusePass())
+#include "llvm/Transforms/Utils/LoopFusePass.h" // FUNCTION_PASS("loop-fuse", LoopFusionPass())
 
 using namespace llvm;
 
+#define DEBUG_TYPE "loop-fuse"
+
+STATISTIC(NumCandidates, "Number of loops considered for fusion");
+STATISTIC(NumBudgetStops, "Number of times a compile-time limit stopped the fusion of some loops");
+STATISTIC(NumColdLoops, "Number of loops not considered for fusion because the profile marks them as cold");
+STATISTIC(NumFusedLoops, "Number of loops fused");
+STATISTIC(NumFusionAttempts, "Number of loop pairs checked for fusion");
+STATISTIC(NumDependenceQueries, "Number of dependence queries between memory accesses");
+STATISTIC(NumMovedInstructions, "Number of instructions moved to make two loops adjacent");
+STATISTIC(NumNotAdjacent, "Number of loop pairs not fused because they are not adjacent");
+STATISTIC(NumTripCountMismatch, "Number of loop pairs not fused because of different trip counts");
+STATISTIC(NumNestMismatch, "Number of loop nests not fused because their shapes differ");
+STATISTIC(NumNotControlFlowEquivalent, "Number of loop pairs not fused because they are not control flow equivalent");
+STATISTIC(NumNegativeDependence, "Number of loop pairs not fused because of a negative distance dependence");
+STATISTIC(NumNotProfitable, "Number of loop pairs not fused because the fusion is not profitable");
+STATISTIC(NumNotVersioned, "Number of loop pairs not fused because the runtime alias checks they need cannot be emitted");
+STATISTIC(NumVersionedFusions, "Number of fusions guarded by runtime alias checks");
+STATISTIC(NumForwardedLoads, "Number of loads replaced by the value stored in the same iteration of a fused loop");
+STATISTIC(NumContractedArrays, "Number of temporary local arrays removed or replaced with a scalar after fusion");
+STATISTIC(NumShiftedLoops, "Number of loops delayed by a few iterations to fuse them past a negative distance dependence");
+STATISTIC(NumPeeledLoops, "Number of loops whose extra iterations were peeled to fuse them");
+STATISTIC(NumNotMergeable, "Number of loop pairs not fused because their headers, latches or induction variables cannot be merged");
+STATISTIC(NumParallelLoops, "Number of fused loops whose accesses are marked as free of loop-carried dependences");
+STATISTIC(NumFusionGroups, "Number of groups of loops chosen by the fusion graph partitioning");
+STATISTIC(NumMergedGuards, "Number of loop guards removed because the guard of the previous loop implies them");
+STATISTIC(NumVersionedGuards, "Number of loops copied to give two neighbouring loops the same guard");
+STATISTIC(NumRotatedLoops, "Number of loops rotated to the shape of the loop they are fused with");
+
     
 struct fusionCandidate{
     const SCEV *tripCount;
     Loop* loop;
+    //branch to the unfused copy of the loops, taken when the runtime alias checks fail
+    BranchInst *aliasCheck;
+    unsigned numChecks;
+    //how many times the body runs per entry in the function, used to fuse the hottest loops first
+    uint64_t hotness;
+};
+
+//control flow equivalent fusion candidates, ordered by dominance
+typedef SmallVector<fusionCandidate*, 4> fusionCandidateSet;
+
+//memory accesses of a loop to the same underlying object
+struct accessBucket{
+    SmallVector<Instruction*, 4> reads;
+    SmallVector<Instruction*, 4> writes;
+};
+
+typedef MapVector<const Value*, accessBucket> accessBuckets;
+
+//estimate of what fusing two loops saves and costs, in bytes of memory traffic per iteration
+struct fusionProfitability{
+    int64_t savings;
+    int64_t registerCost;
+    int64_t vectorizationCost;
+};
+
+//addresses [low, high) accessed through a bucket over all the iterations of a loop, as integers
+struct accessRange{
+    const SCEV *low;
+    const SCEV *high;
+};
+
+//compile-time limits of the pass on a function
+struct fusionBudget{
+    unsigned candidates;
+    std::chrono::steady_clock::time_point deadline;
+    bool timedOut;
+};
+
+//comparison that a loop guard tests to enter its loop
+struct guardCondition{
+    ICmpInst::Predicate pred;
+    const SCEV *LHS;
+    const SCEV *RHS;
+};
+
+//an access that is deleted takes its cached recurrence with it; one that is replaced keeps it until it is deleted
+struct addRecCacheConfig : ValueMapConfig<Instruction*> {
+    enum { FollowRAUW = false };
+};
+
+//polynomial recurrence of each memory access, together with the loop it was computed for
+typedef ValueMap<Instruction*, std::pair<Loop*, const SCEVAddRecExpr*>, addRecCacheConfig> addRecCache;
+
+//what canFuseLoops found out about a pair of loops, so that fuseLoopPair or a run do not check them again
+struct fusionPlan{
+    //intervening code moved out of the way, it goes back if the loops are not fused
+    SmallVector<Instruction*, 8> movedInstructions;
+    accessBuckets L1Buckets;
+    accessBuckets L2Buckets;
+    int64_t peelCount;
+    int64_t shift;
+    bool versioned;
+    SmallVector<std::pair<accessRange, accessRange>, 4> ranges;
+    SmallPtrSet<const SCEVPredicate*, 4> predicates;
 };
 
-void updateAnalysisInfo(Function &F, DominatorTree &DT, PostDominatorTree &PDT) {
-    // Ricalcolare il Dominator Tree e il Post Dominator Tree
-    DT.recalculate(F);
-    PDT.recalculate(F);
+static cl::opt<bool> VerifyDomTrees(
+    "loop-fuse-verify-domtree", cl::init(false), cl::Hidden,
+    cl::desc("Check the incrementally updated (post)dominator trees against freshly computed ones after every fusion"));
+
+static cl::opt<unsigned> MaxPeelCount(
+    "loop-fuse-max-peel", cl::init(8),
+    cl::desc("Maximum difference between two trip counts that is peeled off the longer loop to fuse the pair"));
+
+static cl::opt<unsigned> MaxShiftCount(
+    "loop-fuse-max-shift", cl::init(8),
+    cl::desc("Maximum number of iterations the second loop is delayed by to fuse a pair with a negative distance dependence"));
+
+static cl::opt<unsigned> MaxRuntimeChecks(
+    "loop-fuse-max-runtime-checks", cl::init(8),
+    cl::desc("Maximum number of runtime pointer overlap checks guarding the loops fused into one loop"));
+
+static cl::opt<unsigned> MaxFusionGraphSize(
+    "loop-fuse-max-graph-size", cl::init(32),
+    cl::desc("Maximum number of candidates of a fusion graph: larger sets of loops are fused greedily, in program order"));
+
+static cl::opt<bool> FuseColdLoops(
+    "loop-fuse-cold", cl::init(false),
+    cl::desc("Also fuse the loops that the profile marks as cold"));
+
+static cl::opt<unsigned> MaxCandidates(
+    "loop-fuse-max-candidates", cl::init(1024),
+    cl::desc("Maximum number of loops of a function considered for fusion"));
+
+static cl::opt<unsigned> MaxDependenceQueries(
+    "loop-fuse-max-dependence-queries", cl::init(4096),
+    cl::desc("Maximum number of dependence queries between the accesses of two loops"));
+
+static cl::opt<unsigned> MaxLoopSize(
+    "loop-fuse-max-loop-size", cl::init(4096),
+    cl::desc("Maximum number of instructions of a loop considered for fusion"));
+
+static cl::opt<unsigned> TimeBudget(
+    "loop-fuse-time-budget", cl::init(0),
+    cl::desc("Milliseconds the pass may spend on a function, 0 for no limit"));
+
+static cl::opt<bool> VersionGuards(
+    "loop-fuse-version-guards", cl::init(true),
+    cl::desc("Copy a loop so that it gets the same guard as its neighbour, when the guard is not implied by the one it has"));
+
+//largest loop header that is copied to rotate a loop, as in the O3 pipeline
+static const unsigned MaxRotationHeaderSize = 16;
+
+static cl::opt<int> FusionProfitThreshold(
+    "loop-fuse-profit-threshold", cl::init(0),
+    cl::desc("Estimated memory traffic, in bytes per iteration, that a fusion has to save beyond its costs: a fusion is only applied when it saves more"));
+
+//rewrite the terminator of BB through Rewrite and queue the CFG edges it adds or removes in DTU
+void updateTerminator(BasicBlock *BB, DomTreeUpdater &DTU, function_ref<void()> Rewrite) {
+    SmallPtrSet<BasicBlock*, 4> oldSuccessors(succ_begin(BB), succ_end(BB));
+    Rewrite();
+    SmallPtrSet<BasicBlock*, 4> newSuccessors(succ_begin(BB), succ_end(BB));
+
+    SmallVector<DominatorTree::UpdateType, 4> updates;
+    for (BasicBlock *Succ : oldSuccessors){
+        if (!newSuccessors.count(Succ)){
+            updates.push_back({DominatorTree::Delete, BB, Succ});
+        }
+    }
+    for (BasicBlock *Succ : newSuccessors){
+        if (!oldSuccessors.count(Succ)){
+            updates.push_back({DominatorTree::Insert, BB, Succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+}
+
+//compare the incrementally updated dominator tree with the one computed from scratch
+void verifyDomTree(Function &F, DominatorTree &DT) {
+    if (DT.compare(DominatorTree(F))){
+        report_fatal_error("loop-fuse: incrementally updated dominator tree differs from a fresh one");
+    }
+}
+
+//the same for both trees
+void verifyAnalysisInfo(Function &F, DominatorTree &DT, PostDominatorTree &PDT) {
+    verifyDomTree(F, DT);
+    if (PDT.compare(PostDominatorTree(F))){
+        report_fatal_error("loop-fuse: incrementally updated post-dominator tree differs from a fresh one");
+    }
 }
 
+//SE.forgetLoop, that also drops the recurrences cached for the accesses of L: in the scope of L, of its subloops
+//or of the loops around it, they may change with the trip count or the shape of L
+void forgetLoop(Loop *L, ScalarEvolution &SE, addRecCache &AddRecs) {
+    SE.forgetLoop(L);
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            AddRecs.erase(&I);
+        }
+    }
+}
 
-void fuseLoops(Loop *L1, Loop *L2, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, Function &F, DependenceInfo &DI, ScalarEvolution &SE, FunctionAnalysisManager &AM) {  
-    //Replace the uses of the induction variable of the second loop with the induction variable of the first loop.
-    PHINode *index1 = L1->getCanonicalInductionVariable();
-    PHINode *index2 = L2->getCanonicalInductionVariable();
 
-    //check if the induction variables were found
-    if (!index1 || !index2){
-        outs() << "Induction variables not found\n";
-        return;
+//return the outermost loop containing L2 but not L1
+Loop *getExclusiveOutermostLoop(Loop *L1, Loop *L2) {
+    Loop *top = L2;
+    while (top->getParentLoop() && !top->getParentLoop()->contains(L1)){
+        top = top->getParentLoop();
     }
-    
-    //link L1's parent exit to L2's parent exit
-    if(!L1->isOutermost() && !L2->isOutermost()){
-        Loop* L1Parent = L1->getOutermostLoop();
-        Loop* L2Parent = L2->getOutermostLoop();
-        if(L1Parent && L2Parent){
-            L1Parent->getHeader()->getTerminator()->replaceUsesOfWith(L1Parent->getExitBlock(), L2Parent->getExitBlock());
+    return top;
+}
+
+//keep LoopInfo in sync with the fused CFG: drop the blocks that are about to be deleted,
+//move the surviving blocks and subloops of each loop merged into L1, in order, to L1, then erase
+//the merged loop and every ancestor it leaves empty. Tops are the outermost loops returned by getExclusiveOutermostLoop
+void updateLoopInfo(Loop *L1, ArrayRef<Loop*> Merged, ArrayRef<Loop*> Tops, LoopInfo &LI, DomTreeUpdater &DTU) {
+    //the only blocks that can die are the ones of the loops and the blocks linking them,
+    //which belong to the loop enclosing all of them, if any
+    SmallVector<BasicBlock*, 16> candidates;
+    if (Loop *parent = L1->getParentLoop()){
+        candidates.append(parent->blocks().begin(), parent->blocks().end());
+    }else{
+        candidates.append(L1->blocks().begin(), L1->blocks().end());
+        for (Loop *top : Tops){
+            candidates.append(top->blocks().begin(), top->blocks().end());
         }
     }
-    
-    //replace the uses of L2's induction variable with the uses of L1's
-    index2->replaceAllUsesWith(index1);
-    index2->eraseFromParent();
-    
-    //compute the exit blocks of L2
-    SmallVector<BasicBlock*> L2_exit_blocks;
-    L2->getExitBlocks(L2_exit_blocks);
-    
-    //get loop headers
-    BasicBlock* L1_header = L1->getHeader();
-    BasicBlock* L2_header = L2->getHeader();
-
-    //get loop latches
-    BasicBlock* L1_latch = L1->getLoopLatch();
-    BasicBlock* L2_latch = L2->getLoopLatch();
-
-    //get loops body blocks
-    BasicBlock* L1_body_end = L1_latch->getUniquePredecessor();
-    BasicBlock* L2_body_end = L2_latch->getUniquePredecessor();
-    BasicBlock* L2_body_start = nullptr;
-    for (auto sit1 = succ_begin(L2_header); sit1 != succ_end(L2_header); sit1++){
-        BasicBlock *header_successor = dyn_cast<BasicBlock>(*sit1);
-        if (L2->contains(header_successor)){
-            L2_body_start = header_successor;
-            break;
+
+    for (BasicBlock *BB : candidates){
+        if (DTU.isBBPendingDeletion(BB)){
+            LI.removeBlock(BB);
         }
     }
-    //link L1's header to L2's exit
-    for(BasicBlock *BB : L2_exit_blocks){
-        for(pred_iterator pit = pred_begin(BB); pit != pred_end(BB); pit++){
-            BasicBlock *predecessor = dyn_cast<BasicBlock>(*pit);
-            if (predecessor == L2_header){
-                L1_header->getTerminator()->replaceUsesOfWith(L2->getLoopPreheader(), BB);
+
+    for (Loop *L2 : Merged) {
+        //move L2's blocks from L2 and its ancestors to L1 and its ancestors
+        SmallVector<BasicBlock*, 8> L2_blocks(L2->blocks().begin(), L2->blocks().end());
+        for (BasicBlock *BB : L2_blocks){
+            for (Loop *L = L2; L; L = L->getParentLoop()){
+                L->removeBlockFromLoop(BB);
             }
+            for (Loop *L = L1; L; L = L->getParentLoop()){
+                L->addBlockEntry(BB);
+            }
+            if (LI.getLoopFor(BB) == L2){
+                LI.changeLoopFor(BB, L1);
+            }
+        }
+
+        //the subloops of L2 follow the ones of L1, in program order
+        while (!L2->isInnermost()){
+            Loop *child = L2->removeChildLoop(L2->begin());
+            L1->addChildLoop(child);
+        }
+
+        //erase L2, then the ancestors of L2 that are left without blocks
+        Loop *parent = L2->getParentLoop();
+        LI.erase(L2);
+        while (parent && parent->getNumBlocks() == 0){
+            Loop *next = parent->getParentLoop();
+            LI.erase(parent);
+            parent = next;
         }
     }
+}
 
-    //link loop bodies
-    if (L1_latch->getTerminator()->getNumSuccessors() == 1) {
-        //guarded loops, the latch has 1 successor: br label %for.inc
-        //Link L1 body to L2 body: br label %for.inc => br label %for.body4
-        BranchInst *jump_to_L2_body = BranchInst::Create(L2_body_start);
-        ReplaceInstWithInst(L1_body_end->getTerminator(), jump_to_L2_body);
-    }else{
-        //unguarded loops, the latch has 2 successors: br i1 %cmp, label %do.body, label %do.end9
-        //update the phi node at start of L1: [ 0, %entry ], [ %inc, %do.cond ] => [ 0, %entry ], [ %inc, %do.cond7 ]
-        Instruction &first = L1_header->front();
-        BasicBlock *oldBB = L1_body_end->getTerminator()->getSuccessor(0);
-        if (PHINode *phi = dyn_cast<PHINode>(&first)) {
-            // Iterate over all incoming values in the phi node
-            for (unsigned i = 0; i < phi->getNumIncomingValues(); ++i) {
-                if (phi->getIncomingBlock(i) == oldBB) {
-                    phi->setIncomingBlock(i, L2_body_start);
-                    oldBB->getTerminator()->eraseFromParent();
-                    break;
+//report through ORE that L1 and L2 have not been fused; Reason is the machine readable cause
+void reportMissedFusion(Loop *L1, Loop *L2, StringRef RemarkName, StringRef Reason, OptimizationRemarkEmitter &ORE) {
+    ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, RemarkName, L1->getStartLoc(), L1->getHeader())
+               << "loop not fused with the loop at " << ore::NV("SecondLoop", L2->getStartLoc())
+               << ": " << ore::NV("Reason", Reason);
+    });
+}
+
+//first block of the body of a loop that exits from its header, if the header has a single successor in the loop
+BasicBlock *getBodyStart(Loop *L) {
+    BasicBlock *start = nullptr;
+    for (BasicBlock *Succ : successors(L->getHeader())) {
+        if (L->contains(Succ)){
+            if (start){
+                return nullptr;
+            }
+            start = Succ;
+        }
+    }
+    return start;
+}
+
+//an induction variable of L2 seen as a recurrence on L1, that runs the same number of iterations
+const SCEVAddRecExpr *getInductionOnLoop(PHINode *Phi, Loop *L2, Loop *L1, ScalarEvolution &SE) {
+    const SCEVAddRecExpr *rec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Phi));
+    if (!rec || rec->getLoop() != L2 || !rec->isAffine()){
+        return nullptr;
+    }
+    return dyn_cast<SCEVAddRecExpr>(SE.getAddRecExpr(rec->getStart(), rec->getStepRecurrence(SE), L1, rec->getNoWrapFlags()));
+}
+
+//check if fuseLoops can merge L2 into the loops of Run, that are already known to be mergeable and are fused into
+//the first one, L1: all the loops exit from their header (for) or from their latch (do-while), the header phis of L2
+//can be moved to L1 and the code of L2's header and latch can be moved to L1's ones.
+//L1 may be entered from its alias checks instead of a preheader
+bool canMergeLoops(ArrayRef<Loop*> Run, Loop *L2, DominatorTree &DT, ScalarEvolution &SE) {
+    Loop *L1 = Run.front();
+    for (Loop *L : {L1, L2}) {
+        BasicBlock *latch = L->getLoopLatch();
+        BasicBlock *exiting = L->getExitingBlock();
+        if (!L->getLoopPredecessor() || !latch || latch == L->getHeader() || !exiting || !L->getExitBlock() ||
+            (exiting != L->getHeader() && exiting != latch)){
+            return false;
+        }
+    }
+
+    BasicBlock *L1_header = L1->getHeader();
+    BasicBlock *L2_header = L2->getHeader();
+    bool exitsFromHeader = L1->getExitingBlock() == L1_header;
+    if (exitsFromHeader != (L2->getExitingBlock() == L2_header) || Run.back()->getExitBlock() != L2->getLoopPreheader()){
+        return false;
+    }
+
+    //the body of L2 is entered from its header only, or is the header itself
+    if (exitsFromHeader){
+        BasicBlock *L2_body_start = getBodyStart(L2);
+        if (!L2_body_start || L2_body_start == L2->getLoopLatch() || L2_body_start->getSinglePredecessor() != L2_header){
+            return false;
+        }
+    }
+
+    //the latch of L1, and what the other loops of the run move into it, will run after the body of L2
+    for (Instruction &I : *Run.back()->getLoopLatch()) {
+        if (I.mayReadOrWriteMemory()){
+            return false;
+        }
+    }
+
+    //L2 cannot see the values the loops of the run have on exit anymore
+    auto isDefinedInRun = [&](Value *V) {
+        Instruction *I = dyn_cast<Instruction>(V);
+        return I && any_of(Run, [&](Loop *L) { return L->contains(I); });
+    };
+    for (BasicBlock *BB : L2->blocks()) {
+        for (Instruction &I : *BB) {
+            if (any_of(I.operands(), isDefinedInRun)){
+                return false;
+            }
+        }
+    }
+
+    //what moves from L2 to the header or the latch of L1 must only use values available there
+    auto isAvailable = [&](Value *V) {
+        Instruction *I = dyn_cast<Instruction>(V);
+        return !I || L2->contains(I) || DT.dominates(I, L1_header);
+    };
+    SCEVExpander Expander(SE, L1_header->getModule()->getDataLayout(), "fuse");
+    for (PHINode &phi : L2_header->phis()) {
+        if (const SCEVAddRecExpr *rec = getInductionOnLoop(&phi, L2, L1, SE)){
+            if (!Expander.isSafeToExpandAt(rec, &*L1_header->getFirstInsertionPt())){
+                return false;
+            }
+        } else if (!isAvailable(phi.getIncomingValueForBlock(L2->getLoopPreheader()))){
+            return false;
+        }
+    }
+    if (exitsFromHeader){
+        for (Instruction &I : *L2_header) {
+            if (!isa<PHINode>(I) && !I.isTerminator() && (I.mayHaveSideEffects() || I.mayReadFromMemory() || !all_of(I.operands(), isAvailable))){
+                return false;
+            }
+        }
+    }
+    for (Instruction &I : *L2->getLoopLatch()) {
+        if (!all_of(I.operands(), isAvailable)){
+            return false;
+        }
+    }
+    return true;
+}
+
+//merge the llvm.loop metadata of the fused loops, in order. A property set by a single loop is kept, so that its pragmas
+//survive the fusion, except for the ones that only hold if every loop has them; conflicting integer values (widths,
+//counts, enables) keep the smaller, more conservative one and any other conflict keeps the value of the first loop.
+//The parallel accesses of each loop say nothing about the fused one, they are proven again by markParallelAccesses
+MDNode *mergeLoopMetadata(ArrayRef<MDNode*> LoopIDs, LLVMContext &Ctx) {
+    SmallVector<Metadata*, 4> locations;
+    MapVector<StringRef, MDNode*> properties;
+    StringMap<unsigned> occurrences;
+    for (MDNode *LoopID : LoopIDs) {
+        if (!LoopID){
+            continue;
+        }
+        for (const MDOperand &operand : drop_begin(LoopID->operands())) {
+            MDNode *property = dyn_cast<MDNode>(operand);
+            MDString *name = property && property->getNumOperands() ? dyn_cast<MDString>(property->getOperand(0)) : nullptr;
+            //the source locations of the fused loop are the ones of the first loop
+            if (!name){
+                if (LoopID == LoopIDs.front()){
+                    locations.push_back(operand);
                 }
+                continue;
+            }
+            if (name->getString() == "llvm.loop.parallel_accesses"){
+                continue;
+            }
+
+            ++occurrences[name->getString()];
+            auto inserted = properties.insert({name->getString(), property});
+            MDNode *&merged = inserted.first->second;
+            if (inserted.second || merged == property || merged->getNumOperands() != 2 || property->getNumOperands() != 2){
+                continue;
+            }
+            ConstantInt *mergedValue = mdconst::dyn_extract<ConstantInt>(merged->getOperand(1));
+            ConstantInt *value = mdconst::dyn_extract<ConstantInt>(property->getOperand(1));
+            if (mergedValue && value && mergedValue->getType() == value->getType() && value->getValue().ult(mergedValue->getValue())){
+                merged = property;
             }
         }
-        //Link L1 body to L2 body: br label %do.cond => br label %do.body1
-        BranchInst *jump_to_L2_body = BranchInst::Create(L2_body_start->getTerminator()->getSuccessor(0));
-        ReplaceInstWithInst(L1_body_end->getTerminator(), jump_to_L2_body);
-        //update branch instruction in order to jump to the body of L1
-        //br i1 %cmp8, label %do.body1, label %do.end9 => br i1 %cmp8, label %do.body0, label %do.end9
-        L2_body_start->getTerminator()->replaceUsesOfWith(L2_header, L1_header);
     }
-    
-    //link L2 body to L1 latch
-    BranchInst *jump_to_L1_latch = BranchInst::Create(L1_latch);
-    ReplaceInstWithInst(L2_body_end->getTerminator(), jump_to_L1_latch);
 
-    //link L2 header to L2 latch
-    BranchInst *jump_to_L2_latch = BranchInst::Create(L2_latch);
-    ReplaceInstWithInst(L2_header->getTerminator(), jump_to_L2_latch);
-    
+    for (StringRef name : {"llvm.loop.mustprogress", "llvm.loop.isvectorized"}) {
+        if (occurrences.lookup(name) != LoopIDs.size()){
+            properties.erase(name);
+        }
+    }
+    if (locations.empty() && properties.empty()){
+        return nullptr;
+    }
+
+    //the first operand of a loop ID refers to the node itself
+    SmallVector<Metadata*, 8> operands = {nullptr};
+    operands.append(locations.begin(), locations.end());
+    for (auto &property : properties) {
+        operands.push_back(property.second);
+    }
+    MDNode *LoopID = MDNode::getDistinct(Ctx, operands);
+    LoopID->replaceOperandWith(0, LoopID);
+    return LoopID;
+}
+
+//merge the loops of Loops into the first one, L1, in a single rewrite; each loop must satisfy canMergeLoops with
+//the ones before it. The bodies are chained in order between the body and the latch of L1, the induction variables
+//of the other loops are rewritten on L1's iterations and their other header phis are moved to L1's header
+void fuseLoops(ArrayRef<Loop*> Loops, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, Function &F, DependenceInfo &DI, ScalarEvolution &SE, addRecCache &AddRecs, FunctionAnalysisManager &AM) {  
+    //every CFG edge change below is recorded here and applied to DT and PDT in one batch
+    DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+
+    Loop *L1 = Loops.front();
+    ArrayRef<Loop*> Merged = Loops.drop_front();
+    BasicBlock *L1_header = L1->getHeader();
+    BasicBlock *L1_preheader = L1->getLoopPredecessor();
+    bool exitsFromHeader = L1->getExitingBlock() == L1_header;
+
+    //replace the induction variables of the merged loops with the same recurrences on L1, es: {1,+,2}<%for.cond6> => 1 + 2 * %i.0.
+    //The recurrences are computed while the IR of all the loops is intact, then the SCEVs of the merged loops
+    //(and of the enclosing loops that only contain them) are forgotten
+    SmallVector<std::pair<PHINode*, const SCEVAddRecExpr*>, 4> inductions;
+    SmallVector<MDNode*, 4> loopIDs = {L1->getLoopID()};
+    SmallVector<Loop*, 4> tops;
+    SmallVector<BasicBlock*, 4> headers, preheaders, starts;
+    for (Loop *L2 : Merged) {
+        for (PHINode &phi : L2->getHeader()->phis()) {
+            if (const SCEVAddRecExpr *rec = getInductionOnLoop(&phi, L2, L1, SE)){
+                inductions.push_back({&phi, rec});
+            }
+        }
+        loopIDs.push_back(L2->getLoopID());
+        tops.push_back(getExclusiveOutermostLoop(L1, L2));
+        headers.push_back(L2->getHeader());
+        preheaders.push_back(L2->getLoopPreheader());
+        starts.push_back(exitsFromHeader ? getBodyStart(L2) : L2->getHeader());
+    }
+    for (Loop *top : tops) {
+        forgetLoop(top, SE, AddRecs);
+    }
 
-    //delete unreachable blocks
-    EliminateUnreachableBlocks(F);
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "fuse");
+    for (auto &induction : inductions) {
+        Value *index = Expander.expandCodeFor(induction.second, induction.first->getType(), &*L1_header->getFirstInsertionPt());
+        LLVM_DEBUG(dbgs() << "Replacing " << *induction.first << " with " << *index << "\n");
+        induction.first->replaceAllUsesWith(index);
+        induction.first->eraseFromParent();
+    }
+
+    //make each body end in a single block without phis, before the latch
+    auto getBodyEnd = [&](Loop *L) {
+        BasicBlock *latch = L->getLoopLatch();
+        if (latch->phis().empty() && latch->getSinglePredecessor()){
+            return latch->getSinglePredecessor();
+        }
+        SplitBlock(latch, latch->getFirstNonPHI(), &DTU, &LI, nullptr, latch->getName() + ".latch");
+        return latch;
+    };
+    SmallVector<BasicBlock*, 4> ends, latches;
+    for (Loop *L : Loops) {
+        ends.push_back(getBodyEnd(L));
+        latches.push_back(L->getLoopLatch());
+    }
+    BasicBlock *L1_latch = latches.front();
+    BasicBlock *L1_exiting = L1->getExitingBlock();
+    BasicBlock *last_exiting = Loops.back()->getExitingBlock();
+    BasicBlock *last_exit = Loops.back()->getExitBlock();
+
+    SmallVector<WeakTrackingVH, 8> moved;
+    for (unsigned k = 0; k < Merged.size(); ++k) {
+        //the other phis of the merged loop (reductions, ...) continue in L1's header
+        for (PHINode &phi : make_early_inc_range(headers[k]->phis())) {
+            phi.moveBefore(L1_header->getFirstNonPHI());
+            phi.replaceIncomingBlockWith(preheaders[k], L1_preheader);
+            phi.replaceIncomingBlockWith(latches[k + 1], L1_latch);
+        }
+
+        //the rest of its header and latch runs at the same point of the iteration in L1's ones, after the code of the loops before it
+        if (exitsFromHeader){
+            for (Instruction &I : make_early_inc_range(*headers[k])) {
+                if (!I.isTerminator()){
+                    I.moveBefore(L1_header->getTerminator());
+                    moved.push_back(&I);
+                }
+            }
+        }
+        for (Instruction &I : make_early_inc_range(*latches[k + 1])) {
+            if (!I.isTerminator()){
+                I.moveBefore(L1_latch->getTerminator());
+                moved.push_back(&I);
+            }
+        }
+    }
+
+    //link L1's exit to the exit of the last loop
+    updateTerminator(L1_exiting, DTU, [&]() {
+        L1_exiting->getTerminator()->replaceUsesOfWith(preheaders.front(), last_exit);
+    });
+    //the exiting block of the last loop still branches to the exit until it is deleted with the unreachable blocks
+    for (PHINode &phi : last_exit->phis()) {
+        phi.addIncoming(phi.getIncomingValueForBlock(last_exiting), L1_exiting);
+    }
+
+    //link each body to the next one: br label %for.inc => br label %for.body4
+    for (unsigned k = 0; k < Merged.size(); ++k) {
+        BasicBlock *end = ends[k];
+        updateTerminator(end, DTU, [&]() {
+            end->getTerminator()->replaceUsesOfWith(latches[k], starts[k]);
+        });
+        if (exitsFromHeader){
+            starts[k]->replacePhiUsesWith(headers[k], end);
+        }
+    }
+
+    //link the last body to L1 latch: br label %for.inc18 => br label %for.inc
+    BasicBlock *last_end = ends.back();
+    updateTerminator(last_end, DTU, [&]() {
+        last_end->getTerminator()->replaceUsesOfWith(latches.back(), L1_latch);
+    });
+
+    //the preheaders, headers and latches of the merged loops are not reachable anymore
+    EliminateUnreachableBlocks(F, &DTU);
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(moved);
+
+    //update LoopInfo before the dead blocks are actually deleted
+    updateLoopInfo(L1, Merged, tops, LI, DTU);
+    L1->setLoopID(mergeLoopMetadata(loopIDs, F.getContext()));
+
+    //fusing nests makes their subloops siblings: fold each block that now links two of them
+    //into the exit of the previous subloop, so that it also becomes the preheader of the next one.
+    //Going backwards, a linking block that was merged away is never visited again
+    if (!L1->isInnermost()){
+        for (unsigned k = Merged.size(); k-- > 0;) {
+            if (starts[k]->getSinglePredecessor() == ends[k]){
+                MergeBlockIntoPredecessor(starts[k], &DTU, &LI);
+            }
+        }
+    }
+
+    //L1 now contains the blocks of the merged loops
+    SE.forgetLoopDispositions();
 
+    //apply the pending updates to DT and PDT
+    DTU.flush();
 
-    //update analysis info after the change
-    updateAnalysisInfo(F, DT, PDT);
+    if (VerifyDomTrees){
+        verifyAnalysisInfo(F, DT, PDT);
+    }
 
-    outs() << "Deleted unreachable blocks\n";
+    LLVM_DEBUG(dbgs() << "Deleted unreachable blocks\n");
 }
 
 bool areLoopsAdjacent(Loop *L1, Loop *L2) {
     if (!L1 || !L2) {
-        outs() << "Either L1 or L2 is a NULL pointer \n";
+        LLVM_DEBUG(dbgs() << "Either L1 or L2 is a NULL pointer \n");
         return false;
     }
 
     if (L1->isGuarded() && L2->isGuarded()) {
         BranchInst *L1Guard = L1->getLoopGuardBranch();
-        outs() << "L1 and L2 are guarded loops \n";
+        LLVM_DEBUG(dbgs() << "L1 and L2 are guarded loops \n");
         for (unsigned i = 0; i < L1Guard->getNumSuccessors(); ++i) {
             if (!L1->contains(L1Guard->getSuccessor(i)) && L1Guard->getSuccessor(i) == L2->getHeader()) {
-                outs() << "The non-loop successor of the guard branch of L1 corresponds to L2's entry block \n";
+                LLVM_DEBUG(dbgs() << "The non-loop successor of the guard branch of L1 corresponds to L2's entry block \n");
                 return true;
             }
         }
     } else if (!L1->isGuarded() && !L2->isGuarded()) {
-        outs() << "L1 and L2 are unguarded loops \n";
+        LLVM_DEBUG(dbgs() << "L1 and L2 are unguarded loops \n");
         BasicBlock *L1ExitingBlock = L1->getExitBlock();
         BasicBlock *L2Preheader = L2->getLoopPreheader();
 
         if(!L2Preheader){
-            outs() << "L2 has a NULL Preheader! \n";
+            LLVM_DEBUG(dbgs() << "L2 has a NULL Preheader! \n");
             return false;
         } 
         
-        outs() << "L2Preheader: ";
-        L2Preheader->print(outs());
-        outs() << "\n";
+        LLVM_DEBUG(dbgs() << "L2Preheader: " << *L2Preheader << "\n");
 
 
         if(!L1ExitingBlock){
@@ -163,19 +621,12 @@ bool areLoopsAdjacent(Loop *L1, Loop *L2) {
         }
 
 
-        outs() << "L1ExitingBlock: ";
-        L1ExitingBlock->print(outs());
-        outs() << "\n";
+        LLVM_DEBUG(dbgs() << "L1ExitingBlock: " << *L1ExitingBlock << "\n");
 
             if (L1ExitingBlock && L2Preheader){
             if(L1ExitingBlock == L2Preheader){
-                int instructionCount = 0;
-                for (Instruction &I : *L1ExitingBlock) {
-                    ++instructionCount;
-                    outs() << "Found instruction " << I << " inside the preheader \n";
-                }
-                if (instructionCount == 1){
-                    outs() << "The exit block of L1 corresponds to the preheader of L2 \n";
+                if (L1ExitingBlock->size() == 1){
+                    LLVM_DEBUG(dbgs() << "The exit block of L1 corresponds to the preheader of L2 \n");
                     return true;
                 }
                 return false;
@@ -184,111 +635,319 @@ bool areLoopsAdjacent(Loop *L1, Loop *L2) {
 
         
     } else {
-        outs() << "One loop is guarded, the other one is not \n";
+        LLVM_DEBUG(dbgs() << "One loop is guarded, the other one is not \n");
     }
 
     return false;
 }
 
+//make the last loop of Run and L2, both unguarded, adjacent by moving the instructions of the block between them:
+//first above the first loop of Run, then what cannot be hoisted below L2. Moved receives the instructions of the block
+//in order, so that restoreInterveningCode can put them back when only part of them can be moved, or when the loops
+//end up not being fused
+bool moveInterveningCode(ArrayRef<Loop*> Run, Loop *L2, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, SmallVectorImpl<Instruction*> &Moved) {
+    Loop *L1 = Run.back();
+    if (Run.front()->isGuarded() || L1->isGuarded() || L2->isGuarded()){
+        return false;
+    }
+
+    BasicBlock *RunPreheader = Run.front()->getLoopPreheader();
+    BasicBlock *L2Preheader = L2->getLoopPreheader();
+    BasicBlock *L2Exit = L2->getExitBlock();
+    if (!RunPreheader || !L2Preheader || !L2Exit || L1->getExitBlock() != L2Preheader || !L2Preheader->phis().empty()){
+        return false;
+    }
+
+    for (Instruction &I : *L2Preheader){
+        if (!I.isTerminator()){
+            Moved.push_back(&I);
+        }
+    }
+
+    //hoist in program order, so that every instruction finds its operands already above the run
+    SmallVector<Instruction*, 8> remaining;
+    Instruction *hoistPoint = RunPreheader->getTerminator();
+    for (Instruction *I : Moved) {
+        if (isSafeToMoveBefore(*I, *hoistPoint, DT, &PDT, &DI)){
+            LLVM_DEBUG(dbgs() << "Hoisting " << *I << " above " << Run.front()->getName() << " \n");
+            I->moveBefore(hoistPoint);
+        }else{
+            remaining.push_back(I);
+        }
+    }
+
+    //sink the rest in reverse order, so that they keep their relative order after L2
+    Instruction *sinkPoint = &*L2Exit->getFirstInsertionPt();
+    for (Instruction *I : reverse(remaining)) {
+        if (!isSafeToMoveBefore(*I, *sinkPoint, DT, &PDT, &DI)){
+            LLVM_DEBUG(dbgs() << "Cannot move " << *I << " out of the way \n");
+            return false;
+        }
+        LLVM_DEBUG(dbgs() << "Sinking " << *I << " below L2 \n");
+        I->moveBefore(sinkPoint);
+        sinkPoint = I;
+    }
+    return true;
+}
+
+//put the instructions that moveInterveningCode moved out of the way back between the loops, in their original order
+void restoreInterveningCode(ArrayRef<Instruction*> Moved, Loop *L2) {
+    if (Moved.empty()){
+        return;
+    }
+    Instruction *insertPoint = L2->getLoopPreheader()->getTerminator();
+    for (Instruction *I : Moved) {
+        I->moveBefore(insertPoint);
+    }
+}
+
 bool controlFlowEquivalent(Loop* L1, Loop* L2, DominatorTree &DT, PostDominatorTree &PDT){
     return (DT.dominates(L1->getHeader(), L2->getHeader()) && PDT.dominates(L2->getHeader(), L1->getHeader()));
 }
 
 //returns a polynomial recurrence on the trip count of a load/store instruction
-const SCEVAddRecExpr* getSCEVAddRec(Instruction *I, Loop *L, ScalarEvolution &SE) {
-    SmallPtrSet<const SCEVPredicate *, 4> preds;
-    //SCEV representation of the pointer operand of the load/store instruction inside the scope of the loop
-    const SCEV *Instruction_SCEV = SE.getSCEVAtScope(getLoadStorePointerOperand(I), L);
-    //convert the SCEV instruction to a polynomial recurrence on the trip count of the specified loop
-    const SCEVAddRecExpr *rec = SE.convertSCEVToAddRecWithPredicates(Instruction_SCEV, L, preds);
+const SCEVAddRecExpr* getSCEVAddRec(Instruction *I, Loop *L, ScalarEvolution &SE, addRecCache &AddRecs) {
+    //the recurrence is only reused while I is queried in the scope of the same loop
+    auto cached = AddRecs.find(I);
+    if (cached != AddRecs.end() && cached->second.first == L){
+        return cached->second.second;
+    }
+
+    const SCEVAddRecExpr *rec = nullptr;
+    if (Value *pointer = getLoadStorePointerOperand(I)){
+        SmallPtrSet<const SCEVPredicate *, 4> preds;
+        //SCEV representation of the pointer operand of the load/store instruction inside the scope of the loop
+        const SCEV *Instruction_SCEV = SE.getSCEVAtScope(pointer, L);
+        //convert the SCEV instruction to a polynomial recurrence on the trip count of the specified loop
+        rec = SE.convertSCEVToAddRecWithPredicates(Instruction_SCEV, L, preds);
+    }
+    AddRecs[I] = {L, rec};
     return rec;
 }
 
-bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instruction *inst2, ScalarEvolution &SE) {   
-    outs() << "Checking if the access distance between " << *inst1 << " and " << *inst2 << " is negative\n";
-    //get polynomial recurrences on the trip count for the dependend instructions
-    const SCEVAddRecExpr *inst1_add_rec = getSCEVAddRec(inst1, loop1, SE); //es: {%a,+,4}<nw><%for.cond>
-    const SCEVAddRecExpr *inst2_add_rec = getSCEVAddRec(inst2, loop2, SE);
+//a loop that exits from its header and has a separate latch, as a for loop before rotation
+bool isHeaderExiting(Loop *L) {
+    return L->getExitingBlock() == L->getHeader() && L->getLoopLatch() != L->getHeader();
+}
 
-    //check if both polynomial recurrences were found
-    if (!(inst1_add_rec && inst2_add_rec)) {
-        outs() << "Can't find a polynomial recurrence for inst!\n";
+//index of the last iteration of L in which I runs, counting from 0, given the number of backedges L takes, or nullptr
+//if it cannot be computed. In a loop that exits from its header the rest of the body runs one time less than the header;
+//when it runs at all, a backedge-taken count like (0 smax X) is X
+const SCEV *getLastIteration(Loop *L, Instruction *I, const SCEV *Backedges, Type *Ty, ScalarEvolution &SE) {
+    const SCEV *backedges = Backedges;
+    if (isa<SCEVCouldNotCompute>(backedges)){
+        return nullptr;
+    }
+    if (!isHeaderExiting(L) || I->getParent() == L->getHeader()){
+        return SE.getNoopOrZeroExtend(backedges, Ty);
+    }
+
+    if (isa<SCEVSMaxExpr>(backedges) || isa<SCEVUMaxExpr>(backedges)){
+        const SCEVNAryExpr *max = cast<SCEVNAryExpr>(backedges);
+        const SCEVConstant *bound = dyn_cast<SCEVConstant>(max->getOperand(0));
+        if (max->getNumOperands() == 2 && bound && bound->getAPInt().sle(0)){
+            backedges = max->getOperand(1);
+        }
+    }
+    return SE.getMinusSCEV(SE.getNoopOrZeroExtend(backedges, Ty), SE.getOne(Ty));
+}
+
+//size in bytes of the memory accessed by a load/store, 0 for any other instruction
+uint64_t getAccessSize(Instruction *I, const DataLayout &DL) {
+    if (!getLoadStorePointerOperand(I)){
+        return 0;
+    }
+    return DL.getTypeStoreSize(getLoadStoreType(I)).getFixedValue();
+}
+
+//addresses an access covers in one iteration of L, a loop that contains it, over all the iterations of the loops
+//between them: [start + low, start + high], where {start,+,step} is the recurrence of the access on L with the loops
+//inside L at their first iteration
+struct iterationFootprint{
+    const SCEV *start;
+    const SCEV *step;
+    const SCEV *low;
+    const SCEV *high;
+};
+
+bool getIterationFootprint(Instruction *I, Loop *L, ScalarEvolution &SE, iterationFootprint &footprint) {
+    Value *pointer = getLoadStorePointerOperand(I);
+    if (!pointer){
         return false;
     }
+    SmallVector<Loop*, 4> inner;
+    for (Loop *M = L; M;) {
+        auto sub = find_if(M->getSubLoops(), [&](Loop *Sub) { return Sub->contains(I); });
+        M = sub == M->getSubLoops().end() ? nullptr : *sub;
+        if (M){
+            inner.push_back(M);
+        }
+    }
 
-    outs() << "Polynomial recurrence of " << *inst1 << ": ";
-    inst1_add_rec->print(outs());
-    outs()  << "\n";
+    const DataLayout &DL = I->getModule()->getDataLayout();
+    Type *Ty = DL.getIndexType(pointer->getType());
+    const SCEV *address = SE.getSCEV(pointer);
+    const SCEV *low = SE.getZero(Ty);
+    const SCEV *high = SE.getConstant(Ty, getAccessSize(I, DL) - 1);
+    SmallPtrSet<const SCEVPredicate*, 4> preds;
+    //from the innermost loop outward, take the address back to the first iteration and widen the range by what it covers
+    for (Loop *M : reverse(inner)) {
+        if (SE.isLoopInvariant(address, M)){
+            continue;
+        }
+        const SCEVAddRecExpr *rec = SE.convertSCEVToAddRecWithPredicates(address, M, preds);
+        const SCEV *last = getLastIteration(M, I, SE.getBackedgeTakenCount(M), Ty, SE);
+        if (!rec || !rec->isAffine() || !last){
+            return false;
+        }
+        const SCEV *step = rec->getStepRecurrence(SE);
+        const SCEV *extent = SE.getMulExpr(SE.getNoopOrSignExtend(step, Ty), last);
+        if (SE.isKnownNonNegative(step)){
+            high = SE.getAddExpr(high, extent);
+        } else if (SE.isKnownNonPositive(step)){
+            low = SE.getAddExpr(low, extent);
+        }else{
+            return false;
+        }
+        address = rec->getStart();
+    }
 
-    outs() << "Pointer base of ";
-    inst1_add_rec->print(outs());
-    outs() << ": ";
-    SE.getPointerBase(inst1_add_rec)->print(outs());
-    outs() << "\n";
-    
+    const SCEVAddRecExpr *rec = SE.convertSCEVToAddRecWithPredicates(address, L, preds);
+    if (!rec || !rec->isAffine()){
+        return false;
+    }
+    footprint = {rec->getStart(), SE.getNoopOrSignExtend(rec->getStepRecurrence(SE), Ty), low, high};
+    return true;
+}
 
-    outs() << "Polynomial recurrence of " << *inst2 << ": ";
-    inst2_add_rec->print(outs());
-    outs()  << "\n";
+//the accesses of two nests are compared one iteration of the outer loops at a time: once the outer loops are fused,
+//the iteration i of loop2 runs before the iterations i + k of loop1, k > 0, and must not touch what they touch.
+//distance is -k for the farthest such k
+bool isFootprintDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instruction *inst2, ScalarEvolution &SE, bool &unknown, int64_t &distance) {
+    iterationFootprint first;
+    iterationFootprint second;
+    if (!getIterationFootprint(inst1, loop1, SE, first) || !getIterationFootprint(inst2, loop2, SE, second)){
+        LLVM_DEBUG(dbgs() << "Cannot compute the addresses of " << *inst1 << " or " << *inst2 << " per outer iteration\n");
+        unknown = true;
+        return true;
+    }
 
-    outs() << "Pointer base of ";
-    inst2_add_rec->print(outs());
-    outs() << ": ";
-    SE.getPointerBase(inst2_add_rec)->print(outs());
-    outs() << "\n";
+    if (SE.getPointerBase(first.start) != SE.getPointerBase(second.start)) {
+        LLVM_DEBUG(dbgs() << "Different pointer base\n");
+        unknown = true;
+        return true;
+    }
 
-    //if the instructions don't share the same pointer base, then the dependence is not negative 
-    if (SE.getPointerBase(inst1_add_rec) != SE.getPointerBase(inst2_add_rec)) { //es: %a != %b
-        outs() << "Different pointer base\n";
+    //both ranges relative to the first address of inst1
+    const SCEV *delta = SE.getMinusSCEV(second.start, first.start);
+    const SCEV *step = first.step;
+    if (isa<SCEVCouldNotCompute>(delta) || step != second.step || step->isZero()){
+        unknown = true;
+        return true;
+    }
+    const SCEV *low1 = first.low;
+    const SCEV *high1 = first.high;
+    const SCEV *low2 = SE.getAddExpr(delta, second.low);
+    const SCEV *high2 = SE.getAddExpr(delta, second.high);
+    LLVM_DEBUG(dbgs() << "Per outer iteration: [" << *low1 << ", " << *high1 << "] and [" << *low2 << ", " << *high2 << "], stride " << *step << "\n");
+
+    const SCEVConstant *constStep = dyn_cast<SCEVConstant>(step);
+    if (constStep && isa<SCEVConstant>(low1) && isa<SCEVConstant>(high1) && isa<SCEVConstant>(low2) && isa<SCEVConstant>(high2)){
+        int64_t S = constStep->getAPInt().getSExtValue();
+        int64_t lo1 = cast<SCEVConstant>(low1)->getAPInt().getSExtValue();
+        int64_t hi1 = cast<SCEVConstant>(high1)->getAPInt().getSExtValue();
+        int64_t lo2 = cast<SCEVConstant>(low2)->getAPInt().getSExtValue();
+        int64_t hi2 = cast<SCEVConstant>(high2)->getAPInt().getSExtValue();
+        //a negative stride is a positive one over the mirrored ranges
+        if (S < 0){
+            S = -S;
+            std::tie(lo1, hi1) = std::make_pair(-hi1, -lo1);
+            std::tie(lo2, hi2) = std::make_pair(-hi2, -lo2);
+        }
+        //the range of inst2 overlaps the one of inst1 k iterations later when lo2 - hi1 <= k * S <= hi2 - lo1
+        auto divide = [&](int64_t numerator, APInt::Rounding rounding) {
+            return APIntOps::RoundingSDiv(APInt(64, numerator, true), APInt(64, S, true), rounding).getSExtValue();
+        };
+        int64_t lowest = std::max<int64_t>(1, divide(lo2 - hi1, APInt::Rounding::UP));
+        int64_t farthest = divide(hi2 - lo1, APInt::Rounding::DOWN);
+        if (lowest > farthest){
+            return false;
+        }
+        distance = -farthest;
+        LLVM_DEBUG(dbgs() << *inst1 << " and " << *inst2 << " are dependent across " << farthest << " outer iterations \n");
+        return true;
+    }
+
+    //with symbolic bounds, the range of inst2 must end before the one of inst1 an iteration later begins
+    if ((SE.isKnownPositive(step) && SE.isKnownPredicate(ICmpInst::ICMP_SLT, SE.getMinusSCEV(high2, low1), step)) ||
+        (SE.isKnownNegative(step) && SE.isKnownPredicate(ICmpInst::ICMP_SGT, SE.getMinusSCEV(low2, high1), step))){
         return false;
     }
+    unknown = true;
+    return true;
+}
+
+//unknown is set when the distance cannot be computed, and true is returned to be safe.
+//Otherwise distance is the number of iterations between the two accesses
+bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instruction *inst2, ScalarEvolution &SE, addRecCache &AddRecs, bool &unknown, int64_t &distance) {   
+    LLVM_DEBUG(dbgs() << "Checking if the access distance between " << *inst1 << " and " << *inst2 << " is negative\n");
+    unknown = false;
+    distance = 0;
+    if (!loop1->isInnermost() || !loop2->isInnermost()){
+        return isFootprintDistanceNegative(loop1, loop2, inst1, inst2, SE, unknown, distance);
+    }
+
+    //get polynomial recurrences on the trip count for the dependend instructions
+    const SCEVAddRecExpr *inst1_add_rec = getSCEVAddRec(inst1, loop1, SE, AddRecs); //es: {%a,+,4}<nw><%for.cond>
+    const SCEVAddRecExpr *inst2_add_rec = getSCEVAddRec(inst2, loop2, SE, AddRecs);
+
+    //check if both polynomial recurrences were found
+    if (!(inst1_add_rec && inst2_add_rec)) {
+        LLVM_DEBUG(dbgs() << "Can't find a polynomial recurrence for inst!\n");
+        unknown = true;
+        return true;
+    }
+
+    LLVM_DEBUG(dbgs() << "Polynomial recurrence of " << *inst1 << ": " << *inst1_add_rec << "\n");
+    LLVM_DEBUG(dbgs() << "Pointer base of " << *inst1_add_rec << ": " << *SE.getPointerBase(inst1_add_rec) << "\n");
+
+    LLVM_DEBUG(dbgs() << "Polynomial recurrence of " << *inst2 << ": " << *inst2_add_rec << "\n");
+    LLVM_DEBUG(dbgs() << "Pointer base of " << *inst2_add_rec << ": " << *SE.getPointerBase(inst2_add_rec) << "\n");
+
+    //if the instructions don't share the same pointer base, as two pointer arguments that may alias, the distance is unknown
+    if (SE.getPointerBase(inst1_add_rec) != SE.getPointerBase(inst2_add_rec)) { //es: %a != %b
+        LLVM_DEBUG(dbgs() << "Different pointer base\n");
+        unknown = true;
+        return true;
+    }
 
     //extract the start addresses of the polynomial recurrences
     //address value at the start of the loop.
     const SCEV* start_first_inst = inst1_add_rec->getStart(); //es: %a
     const SCEV* start_second_inst = inst2_add_rec->getStart();
     
-    outs() << "Start index of ";
-    inst1_add_rec->print(outs());
-    outs() << ": ";
-    start_first_inst->print(outs());
-    outs() << "\n";
-
-    outs() << "Start index of ";
-    inst2_add_rec->print(outs());
-    outs() << ": ";
-    start_second_inst->print(outs());
-    outs() << "\n";
+    LLVM_DEBUG(dbgs() << "Start index of " << *inst1_add_rec << ": " << *start_first_inst << "\n");
+    LLVM_DEBUG(dbgs() << "Start index of " << *inst2_add_rec << ": " << *start_second_inst << "\n");
 
     //extract the stride of the polynomial recurrences
     //change of the address at each loop iteration
     const SCEV* stride_first_inst = inst1_add_rec->getStepRecurrence(SE); //es: 4
     const SCEV* stride_second_inst = inst2_add_rec->getStepRecurrence(SE);
 
-    outs() << "Stride index of ";
-    inst1_add_rec->print(outs());
-    outs() << ": ";
-    stride_first_inst->print(outs());
-    outs() << "\n";
-
-    outs() << "Stride index of ";
-    inst2_add_rec->print(outs());
-    outs() << ": ";
-    stride_second_inst->print(outs());
-    outs() << "\n";
+    LLVM_DEBUG(dbgs() << "Stride index of " << *inst1_add_rec << ": " << *stride_first_inst << "\n");
+    LLVM_DEBUG(dbgs() << "Stride index of " << *inst2_add_rec << ": " << *stride_second_inst << "\n");
 
     //ensure the stride is non-zero and both strides are equal
     if (!SE.isKnownNonZero(stride_first_inst) || stride_first_inst != stride_second_inst) {
-        outs() << "Cannot compute distance\n";
+        LLVM_DEBUG(dbgs() << "Cannot compute distance\n");
+        unknown = true;
         return true;
     }
 
     //compute the distance (delta) between the start addresses
     const SCEV *inst_delta = SE.getMinusSCEV(start_first_inst, start_second_inst);
     
-    outs() << "Delta: ";
-    inst_delta->print(outs());
-    outs() << "\n";
+    LLVM_DEBUG(dbgs() << "Delta: " << *inst_delta << "\n");
 
     //cast the delta and the stride to SCEVConstant
     const SCEVConstant *const_delta = dyn_cast<SCEVConstant>(inst_delta);
@@ -303,11 +962,7 @@ bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instructio
         //check if |delta| % |stride| != 0 
         if ((int_delta != 0 && int_delta.abs().urem(int_stride.abs()) != 0)){
             //delta is not multiple of the stride
-            outs() << "|delta|: ";
-            int_delta.abs().print(outs(), false);
-            outs() << " not multiple of |stride|: ";
-            int_stride.abs().print(outs(), false);
-            outs() << "\n";
+            LLVM_DEBUG(dbgs() << "|delta|: " << int_delta.abs() << " not multiple of |stride|: " << int_stride.abs() << "\n");
 
             return false;
         }
@@ -322,192 +977,2289 @@ bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instructio
         }else{
             dependence_dist = inst_delta;
         }
+        distance = cast<SCEVConstant>(dependence_dist)->getAPInt().sdiv(int_stride.abs()).getSExtValue();
             
     } else {
-        outs() << "Cannot compute distance\n";
+        LLVM_DEBUG(dbgs() << "Cannot compute distance\n");
+        unknown = true;
         return true;
     }
 
     //check if the dependence distance is negative
     bool isDistanceNegative = SE.isKnownPredicate(ICmpInst::ICMP_SLT, dependence_dist, SE.getZero(stride_first_inst->getType()));
-    if(isDistanceNegative){
-        outs() << *inst1 << " and " << *inst2 << " are dependent with a negative distance \n";
-    }else{
-        outs() << *inst1 << " and " << *inst2 << " are dependent with a NON-negative distance \n";
-    }
-    
-    outs() << "\n";
+    LLVM_DEBUG(dbgs() << *inst1 << " and " << *inst2 << " are dependent with a " << (isDistanceNegative ? "negative" : "NON-negative") << " distance \n\n");
     return isDistanceNegative;
 }
 
-//check if all the dependencies between the two loops are non-negative
-bool dependencesAllowFusion(Loop *L0, Loop *L1, DominatorTree &DT, ScalarEvolution &SE, DependenceInfo &DI) {
-    std::vector<Instruction*> L0MemReads;
-    std::vector<Instruction*> L0MemWrites;
-
-    std::vector<Instruction*> L1MemReads;
-    std::vector<Instruction*> L1MemWrites;
-
-    //collect load and store instructions of L0
-    for (BasicBlock *BB : L0->blocks()) {        
+//group the memory accesses of L by the object they are based on.
+//accesses without a pointer operand (calls, fences, ...) go to the nullptr bucket
+void collectAccessBuckets(Loop *L, accessBuckets &buckets) {
+    for (BasicBlock *BB : L->blocks()) {
         for (Instruction &I : *BB) {
-            if (I.mayWriteToMemory()){
-                L0MemWrites.push_back(&I);
+            if (!I.mayReadOrWriteMemory()){
+                continue;
             }
 
-            if (I.mayReadFromMemory()){
-                L0MemReads.push_back(&I);
-            } 
-        }
-    }
+            const Value *object = nullptr;
+            if (Value *pointer = getLoadStorePointerOperand(&I)){
+                object = getUnderlyingObject(pointer);
+            }
 
-    //collect load and store instructions of L1
-    for (BasicBlock *BB : L1->blocks()) {        
-        for (Instruction &I : *BB) {
+            accessBucket &bucket = buckets[object];
             if (I.mayWriteToMemory()){
-                L1MemWrites.push_back(&I);
+                bucket.writes.push_back(&I);
             }
 
             if (I.mayReadFromMemory()){
-                L1MemReads.push_back(&I);
+                bucket.reads.push_back(&I);
             }
         }
     }
+}
 
-    //check for any negative distance dependency between the store instructions of L0 and the load instructions of L1
-    for (Instruction *WriteL0 : L0MemWrites) { 
-        for (Instruction *ReadL1 : L1MemReads){
-            if(DI.depends(WriteL0, ReadL1, true) && isDistanceNegative(L0, L1, WriteL0, ReadL1, SE)){
-                return false;
-            }
-        }     
+//check if the accesses of two buckets can refer to the same memory
+bool bucketsMayAlias(const Value *object0, const Value *object1, AAResults &AA) {
+    if (!object0 || !object1 || object0 == object1){
+        return true;
     }
+    return !AA.isNoAlias(MemoryLocation::getBeforeOrAfter(object0), MemoryLocation::getBeforeOrAfter(object1));
+}
 
-    //check for any negative distance dependency between the store instructions of L1 and the load instructions of L0
-    for (Instruction *WriteL1 : L1MemWrites) {        
-        for (Instruction *ReadL0 : L0MemReads){
-            if(DI.depends(WriteL1, ReadL0, true) && isDistanceNegative(L0, L1, ReadL0, WriteL1, SE)){
+//a dependence carried by a loop enclosing both fused loops, i.e. whose first non '=' direction excludes '=',
+//is between different iterations of that loop and is not affected by the order of the two loop bodies
+bool isCarriedByCommonLoop(Dependence &D) {
+    for (unsigned level = 1; level <= D.getLevels(); ++level) {
+        unsigned direction = D.getDirection(level);
+        if (direction != Dependence::DVEntry::EQ){
+            return !(direction & Dependence::DVEntry::EQ);
+        }
+    }
+    return false;
+}
+
+//number of DependenceInfo queries dependencesAllowFusion makes for the accesses of two loops
+uint64_t countDependenceQueries(accessBuckets &L0Buckets, accessBuckets &L1Buckets, AAResults &AA) {
+    uint64_t queries = 0;
+    for (auto &L0Bucket : L0Buckets) {
+        for (auto &L1Bucket : L1Buckets) {
+            if (bucketsMayAlias(L0Bucket.first, L1Bucket.first, AA)){
+                queries += L0Bucket.second.writes.size() * L1Bucket.second.reads.size() +
+                           L1Bucket.second.writes.size() * L0Bucket.second.reads.size() +
+                           L0Bucket.second.writes.size() * L1Bucket.second.writes.size();
+            }
+        }
+    }
+    return queries;
+}
+
+//check if all the dependencies between the two loops are non-negative. The pairs of objects whose distance
+//cannot be computed are added to checks: the fusion is legal if their accesses don't overlap at runtime.
+//A negative constant distance is allowed too: shift is set to the number of iterations L0 has to run ahead of L1
+bool dependencesAllowFusion(Loop *L0, Loop *L1, accessBuckets &L0Buckets, accessBuckets &L1Buckets, DominatorTree &DT, ScalarEvolution &SE, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, SmallVectorImpl<std::pair<const Value*, const Value*>> &checks, int64_t &shift) {
+    //only the buckets that may alias need to be checked pairwise
+    for (auto &L0Bucket : L0Buckets) {
+        for (auto &L1Bucket : L1Buckets) {
+            if (!bucketsMayAlias(L0Bucket.first, L1Bucket.first, AA)){
+                continue;
+            }
+
+            bool unknown = false;
+            bool needsCheck = false;
+            int64_t distance = 0;
+
+            //check for any negative distance dependency between the store instructions of L0 and the load instructions of L1
+            for (Instruction *WriteL0 : L0Bucket.second.writes) {
+                for (Instruction *ReadL1 : L1Bucket.second.reads){
+                    ++NumDependenceQueries;
+                    std::unique_ptr<Dependence> dependence = DI.depends(WriteL0, ReadL1, true);
+                    if(dependence && !isCarriedByCommonLoop(*dependence) && isDistanceNegative(L0, L1, WriteL0, ReadL1, SE, AddRecs, unknown, distance)){
+                        if (!unknown){
+                            shift = std::max(shift, -distance);
+                            continue;
+                        }
+                        needsCheck = true;
+                    }
+                }
+            }
+
+            //check for any negative distance dependency between the store instructions of L1 and the load instructions of L0
+            for (Instruction *WriteL1 : L1Bucket.second.writes) {
+                for (Instruction *ReadL0 : L0Bucket.second.reads){
+                    ++NumDependenceQueries;
+                    std::unique_ptr<Dependence> dependence = DI.depends(WriteL1, ReadL0, true);
+                    if(dependence && !isCarriedByCommonLoop(*dependence) && isDistanceNegative(L0, L1, ReadL0, WriteL1, SE, AddRecs, unknown, distance)){
+                        if (!unknown){
+                            shift = std::max(shift, -distance);
+                            continue;
+                        }
+                        needsCheck = true;
+                    }
+                }
+            }
+
+            //check for any negative distance dependency between the store instructions of L0 and the ones of L1,
+            //that would leave the value of L0 in memory instead of the one of L1
+            for (Instruction *WriteL0 : L0Bucket.second.writes) {
+                for (Instruction *WriteL1 : L1Bucket.second.writes){
+                    ++NumDependenceQueries;
+                    std::unique_ptr<Dependence> dependence = DI.depends(WriteL0, WriteL1, true);
+                    if(dependence && !isCarriedByCommonLoop(*dependence) && isDistanceNegative(L0, L1, WriteL0, WriteL1, SE, AddRecs, unknown, distance)){
+                        if (!unknown){
+                            shift = std::max(shift, -distance);
+                            continue;
+                        }
+                        needsCheck = true;
+                    }
+                }
+            }
+
+            //the accesses that are not to a known object cannot be checked at runtime
+            if (needsCheck){
+                if (!L0Bucket.first || !L1Bucket.first){
+                    return false;
+                }
+                checks.push_back({L0Bucket.first, L1Bucket.first});
+            }
+        }
+    }
+    
+    //if we reach this point, all the dependencies are non-negative, once L1 is delayed by shift iterations
+    return true;
+}
+
+
+//two nests are fused one level at a time, from the outermost loop inward, so each one must be a chain
+//with a single subloop per level and the loops at the same depth must have the same trip count
+bool nestsAllowFusion(Loop *L1, Loop *L2, ScalarEvolution &SE) {
+    if (L1->isInnermost() && L2->isInnermost()){
+        return true;
+    }
+
+    LoopNest N1(*L1, SE);
+    LoopNest N2(*L2, SE);
+    ArrayRef<Loop*> L1_loops = N1.getLoops();
+    ArrayRef<Loop*> L2_loops = N2.getLoops();
+    if (N1.getNestDepth() != N2.getNestDepth() || L1_loops.size() != N1.getNestDepth() || L2_loops.size() != N2.getNestDepth()){
+        LLVM_DEBUG(dbgs() << "The nests are not chains of the same depth \n");
+        return false;
+    }
+
+    //the outermost trip counts are compared by the caller
+    for (size_t depth = 1; depth < L1_loops.size(); ++depth) {
+        BasicBlock *L1_exiting = L1_loops[depth]->getExitingBlock();
+        BasicBlock *L2_exiting = L2_loops[depth]->getExitingBlock();
+        if (!L1_exiting || !L2_exiting){
+            return false;
+        }
+        const SCEV *L1_tripCount = SE.getExitCount(L1_loops[depth], L1_exiting, ScalarEvolution::ExitCountKind::Exact);
+        const SCEV *L2_tripCount = SE.getExitCount(L2_loops[depth], L2_exiting, ScalarEvolution::ExitCountKind::Exact);
+        if (isa<SCEVCouldNotCompute>(L1_tripCount) || L1_tripCount != L2_tripCount){
+            LLVM_DEBUG(dbgs() << "The loops at depth " << depth << " have a different trip count \n");
+            return false;
+        }
+    }
+    return true;
+}
+
+//bytes moved by every iteration of a loop through the accesses of its buckets
+uint64_t getBytesPerIteration(accessBuckets &buckets, const DataLayout &DL) {
+    uint64_t bytes = 0;
+    for (auto &bucket : buckets) {
+        for (Instruction *I : bucket.second.reads){
+            bytes += getAccessSize(I, DL);
+        }
+        for (Instruction *I : bucket.second.writes){
+            bytes += getAccessSize(I, DL);
+        }
+    }
+    return bytes;
+}
+
+//each access of L2 to an object L1 also touches reuses data that is still in cache or in a register
+uint64_t getReuseBytes(accessBuckets &L1Buckets, accessBuckets &L2Buckets, const DataLayout &DL) {
+    uint64_t bytes = 0;
+    for (auto &L2Bucket : L2Buckets) {
+        if (!L2Bucket.first || !L1Buckets.count(L2Bucket.first)){
+            continue;
+        }
+        for (Instruction *I : L2Bucket.second.reads){
+            bytes += getAccessSize(I, DL);
+        }
+        for (Instruction *I : L2Bucket.second.writes){
+            bytes += getAccessSize(I, DL);
+        }
+    }
+    return bytes;
+}
+
+//a loop is considered vectorizable if it is innermost and all its memory accesses are loads/stores
+//whose address advances by a constant stride at every iteration. Loops holds the loops that are fused
+//into one, and buckets their accesses, each one checked on the loop it belongs to
+bool isVectorizable(ArrayRef<Loop*> Loops, accessBuckets &buckets, ScalarEvolution &SE, addRecCache &AddRecs) {
+    if (!all_of(Loops, [](Loop *L) { return L->isInnermost(); })){
+        return false;
+    }
+
+    for (auto &bucket : buckets) {
+        if (!bucket.first){
+            return false;
+        }
+        for (auto *accesses : {&bucket.second.reads, &bucket.second.writes}) {
+            for (Instruction *I : *accesses) {
+                Loop *L = *find_if(Loops, [&](Loop *L) { return L->contains(I); });
+                const SCEVAddRecExpr *rec = getSCEVAddRec(I, L, SE, AddRecs);
+                if (!rec || !isa<SCEVConstant>(rec->getStepRecurrence(SE))){
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//number of elements of the widest access of buckets that fit in a vector register of VectorBytes bytes
+uint64_t getVectorizationFactor(accessBuckets &buckets, uint64_t VectorBytes, const DataLayout &DL) {
+    uint64_t maxElementSize = 1;
+    for (auto &bucket : buckets) {
+        for (auto *accesses : {&bucket.second.reads, &bucket.second.writes}) {
+            for (Instruction *I : *accesses){
+                maxElementSize = std::max(maxElementSize, getAccessSize(I, DL));
+            }
+        }
+    }
+    return std::max<uint64_t>(1, VectorBytes / maxElementSize);
+}
+
+//collect the values used by L but defined outside of it; returns the number of values carried across iterations
+unsigned collectLiveValues(Loop *L, SmallPtrSetImpl<Value*> &liveIns) {
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            for (Value *operand : I.operands()) {
+                Instruction *definition = dyn_cast<Instruction>(operand);
+                if ((definition && !L->contains(definition)) || isa<Argument>(operand)){
+                    liveIns.insert(operand);
+                }
+            }
+        }
+    }
+    return std::distance(L->getHeader()->phis().begin(), L->getHeader()->phis().end());
+}
+
+//estimate how much memory traffic the fusion of L2 with the loops of L1s, that are fused into one, saves and how much it costs.
+//L1Buckets holds the accesses of all the loops of L1s. Every quantity is expressed in bytes per iteration
+fusionProfitability estimateProfitability(ArrayRef<Loop*> L1s, Loop *L2, accessBuckets &L1Buckets, accessBuckets &L2Buckets, TargetTransformInfo &TTI, ScalarEvolution &SE, addRecCache &AddRecs, const DataLayout &DL) {
+    fusionProfitability profitability = {0, 0, 0};
+    profitability.savings = getReuseBytes(L1Buckets, L2Buckets, DL);
+
+    //values that don't fit in the registers anymore are spilled and reloaded at every iteration
+    unsigned numRegisters = TTI.getNumberOfRegisters(TTI.getRegisterClassForType(false));
+    SmallPtrSet<Value*, 16> L1LiveIns;
+    SmallPtrSet<Value*, 16> L2LiveIns;
+    int64_t L1Live = 0;
+    for (Loop *L1 : L1s) {
+        L1Live += collectLiveValues(L1, L1LiveIns);
+    }
+    //the loops of L1s are fused into one, with a single induction variable
+    L1Live -= L1s.size() - 1;
+    int64_t L2Live = collectLiveValues(L2, L2LiveIns);
+    //the induction variable of L2 is replaced with the one of L1s
+    int64_t fusedLive = L1Live + L2Live - 1 + L1LiveIns.size();
+    for (Value *V : L2LiveIns){
+        fusedLive += !L1LiveIns.count(V);
+    }
+    L1Live += L1LiveIns.size();
+    L2Live += L2LiveIns.size();
+    auto spilled = [&](int64_t live) { return std::max<int64_t>(0, live - numRegisters); };
+    int64_t newSpills = spilled(fusedLive) - spilled(L1Live) - spilled(L2Live);
+    profitability.registerCost = std::max<int64_t>(0, newSpills) * 2 * DL.getPointerSize();
+
+    //the traffic of each loop is compared as it would be vectorized on its own and inside the fused body: the fused body
+    //is not vectorizable as soon as one of the loops is not, and its widest element lowers the vectorization factor of all of them
+    uint64_t vectorBytes = TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedValue() / 8;
+    if (vectorBytes) {
+        SmallVector<Loop*, 4> fusedLoops(L1s.begin(), L1s.end());
+        fusedLoops.push_back(L2);
+        accessBuckets fusedBuckets = L1Buckets;
+        for (auto &bucket : L2Buckets) {
+            accessBucket &fused = fusedBuckets[bucket.first];
+            fused.reads.append(bucket.second.reads.begin(), bucket.second.reads.end());
+            fused.writes.append(bucket.second.writes.begin(), bucket.second.writes.end());
+        }
+        uint64_t fusedVF = isVectorizable(fusedLoops, fusedBuckets, SE, AddRecs) ? getVectorizationFactor(fusedBuckets, vectorBytes, DL) : 1;
+
+        int64_t cost = 0;
+        auto addCost = [&](ArrayRef<Loop*> Loops, accessBuckets &buckets) {
+            uint64_t VF = isVectorizable(Loops, buckets, SE, AddRecs) ? getVectorizationFactor(buckets, vectorBytes, DL) : 1;
+            uint64_t bytes = getBytesPerIteration(buckets, DL);
+            cost += (int64_t)(bytes / fusedVF) - (int64_t)(bytes / VF);
+        };
+        addCost(L1s, L1Buckets);
+        addCost(L2, L2Buckets);
+        profitability.vectorizationCost = std::max<int64_t>(0, cost);
+    }
+
+    return profitability;
+}
+
+//returns the constant difference A - B of two trip counts. Trip counts like (0 smax X) and
+//(-1 + (1 smax X)) are compared through X: that's their difference whenever the loops run at all
+std::optional<int64_t> getConstantDifference(const SCEV *A, const SCEV *B, ScalarEvolution &SE) {
+    if (const SCEVConstant *difference = dyn_cast<SCEVConstant>(SE.getMinusSCEV(A, B))){
+        return difference->getAPInt().getSExtValue();
+    }
+
+    const SCEVNAryExpr *NA = dyn_cast<SCEVNAryExpr>(A);
+    const SCEVNAryExpr *NB = dyn_cast<SCEVNAryExpr>(B);
+    if (!NA || !NB || NA->getSCEVType() != NB->getSCEVType() || NA->getNumOperands() != 2 || NB->getNumOperands() != 2){
+        return std::nullopt;
+    }
+    if (!(isa<SCEVAddExpr>(NA) || isa<SCEVMinMaxExpr>(NA)) || NA->getOperand(0) != NB->getOperand(0) || !isa<SCEVConstant>(NA->getOperand(0))){
+        return std::nullopt;
+    }
+    return getConstantDifference(NA->getOperand(1), NB->getOperand(1), SE);
+}
+
+//find the exit test of a loop that leaves from its header: br (icmp pred %iv, %bound), %body, %exit
+ICmpInst *getHeaderExitTest(Loop *L) {
+    PHINode *index = L->getCanonicalInductionVariable();
+    BasicBlock *header = L->getHeader();
+    if (!index || L->getExitingBlock() != header || !L->getExitBlock() || !L->getLoopPreheader()){
+        return nullptr;
+    }
+
+    BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
+    if (!branch || !branch->isConditional() || !L->contains(branch->getSuccessor(0))){
+        return nullptr;
+    }
+
+    ICmpInst *compare = dyn_cast<ICmpInst>(branch->getCondition());
+    if (!compare || compare->getOperand(0) != index){
+        return nullptr;
+    }
+    return compare;
+}
+
+//check if the trip counts of two sibling loops differ by a small constant that can be peeled off the longer one.
+//difference is the number of extra iterations of L1 (negative if L2 is the longer loop)
+bool canPeelToCommonTripCount(fusionCandidate *C1, fusionCandidate *C2, ScalarEvolution &SE, int64_t &difference) {
+    Loop *L1 = C1->loop;
+    Loop *L2 = C2->loop;
+    if (!L1->isInnermost() || !L2->isInnermost() || isa<SCEVCouldNotCompute>(C1->tripCount) || isa<SCEVCouldNotCompute>(C2->tripCount)){
+        return false;
+    }
+
+    std::optional<int64_t> tripCountDifference = getConstantDifference(C1->tripCount, C2->tripCount, SE);
+    if (!tripCountDifference || *tripCountDifference == 0 || std::abs(*tripCountDifference) > MaxPeelCount){
+        return false;
+    }
+    difference = *tripCountDifference;
+
+    ICmpInst *L1Test = getHeaderExitTest(L1);
+    ICmpInst *L2Test = getHeaderExitTest(L2);
+    if (!L1Test || !L2Test || L1Test->getPredicate() != L2Test->getPredicate()){
+        return false;
+    }
+
+    //the iterations that are moved after L2 must not feed anything outside the loop, nor carry other values than the index
+    Loop *longer = difference > 0 ? L1 : L2;
+    if (std::next(longer->getHeader()->phis().begin()) != longer->getHeader()->phis().end()){
+        return false;
+    }
+    for (BasicBlock *BB : longer->blocks()) {
+        for (Instruction &I : *BB) {
+            for (User *U : I.users()) {
+                if (!longer->contains(cast<Instruction>(U))){
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//insert after L2 a copy of L that starts from the value L's index has on exit and stops at Bound
+Loop *cloneRemainderLoop(Loop *L, Loop *L2, ICmpInst *Compare, Value *Bound, DomTreeUpdater &DTU, LoopInfo &LI, Function &F) {
+    BasicBlock *L2_header = L2->getHeader();
+    BasicBlock *L2_exit = L2->getExitBlock();
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock*, 8> blocks;
+    for (BasicBlock *BB : L->blocks()) {
+        BasicBlock *newBB = CloneBasicBlock(BB, VMap, ".peel", &F);
+        VMap[BB] = newBB;
+        blocks.push_back(newBB);
+    }
+    remapInstructionsInBlocks(blocks, VMap);
+
+    BasicBlock *header = cast<BasicBlock>(VMap[L->getHeader()]);
+    BasicBlock *preheader = BasicBlock::Create(F.getContext(), "peel.preheader", &F, header);
+    BranchInst::Create(header, preheader);
+
+    //the copy continues from where L stopped
+    PHINode *index = L->getCanonicalInductionVariable();
+    PHINode *newIndex = cast<PHINode>(VMap[index]);
+    int incoming = newIndex->getBasicBlockIndex(L->getLoopPreheader());
+    newIndex->setIncomingBlock(incoming, preheader);
+    newIndex->setIncomingValue(incoming, index);
+
+    //and runs up to the original bound of L
+    ICmpInst *newCompare = cast<ICmpInst>(VMap[Compare]);
+    Value *newBound = VMap.lookup(Bound);
+    newCompare->setOperand(1, newBound ? newBound : Bound);
+    header->getTerminator()->replaceUsesOfWith(L->getExitBlock(), L2_exit);
+
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    updates.push_back({DominatorTree::Insert, preheader, header});
+    for (BasicBlock *BB : blocks) {
+        for (BasicBlock *Succ : successors(BB)){
+            updates.push_back({DominatorTree::Insert, BB, Succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+
+    //L2 now exits into the copy
+    updateTerminator(L2_header, DTU, [&]() {
+        L2_header->getTerminator()->replaceUsesOfWith(L2_exit, preheader);
+    });
+    L2_exit->replacePhiUsesWith(L2_header, header);
+
+    Loop *remainder = LI.AllocateLoop();
+    if (Loop *parent = L2->getParentLoop()){
+        parent->addChildLoop(remainder);
+        parent->addBasicBlockToLoop(preheader, LI);
+    }else{
+        LI.addTopLevelLoop(remainder);
+    }
+    for (BasicBlock *BB : L->blocks()){
+        remainder->addBasicBlockToLoop(cast<BasicBlock>(VMap[BB]), LI);
+    }
+    return remainder;
+}
+
+//make the longer loop run as many iterations as the shorter one, using the bound of the shorter loop,
+//and run the iterations left in a copy of the longer loop placed after L2
+bool peelToCommonTripCount(fusionCandidate *C1, fusionCandidate *C2, int64_t Difference, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, ScalarEvolution &SE, addRecCache &AddRecs, Function &F) {
+    fusionCandidate *longer = Difference > 0 ? C1 : C2;
+    fusionCandidate *shorter = Difference > 0 ? C2 : C1;
+    ICmpInst *longCompare = getHeaderExitTest(longer->loop);
+    ICmpInst *shortCompare = getHeaderExitTest(shorter->loop);
+    Value *longBound = longCompare->getOperand(1);
+
+    const SCEV *shortBound = SE.getSCEV(shortCompare->getOperand(1));
+    Instruction *insertPoint = longer->loop->getLoopPreheader()->getTerminator();
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "peel");
+    if (!SE.isLoopInvariant(shortBound, shorter->loop) || !Expander.isSafeToExpandAt(shortBound, insertPoint)){
+        return false;
+    }
+
+    Value *newBound = Expander.expandCodeFor(shortBound, longBound->getType(), insertPoint);
+    forgetLoop(longer->loop, SE, AddRecs);
+    longCompare->setOperand(1, newBound);
+
+    //give up, restoring the loop, if SCEV does not see the same trip count
+    const SCEV *tripCount = SE.getExitCount(longer->loop, longer->loop->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    if (tripCount != shorter->tripCount){
+        longCompare->setOperand(1, longBound);
+        forgetLoop(longer->loop, SE, AddRecs);
+        RecursivelyDeleteTriviallyDeadInstructions(newBound);
+        return false;
+    }
+    longer->tripCount = tripCount;
+
+    DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+    cloneRemainderLoop(longer->loop, C2->loop, longCompare, longBound, DTU, LI, F);
+    DTU.flush();
+
+    if (VerifyDomTrees){
+        verifyAnalysisInfo(F, DT, PDT);
+    }
+    return true;
+}
+
+//check if L2 can be delayed by Shift iterations: both loops count from 0 up to a bound with the same
+//strict test, and carry nothing but their index, so the iterations run apart can be moved to copies of the loops
+bool canShiftLoops(fusionCandidate *C1, fusionCandidate *C2, int64_t Shift, ScalarEvolution &SE) {
+    Loop *L1 = C1->loop;
+    Loop *L2 = C2->loop;
+    if (Shift > MaxShiftCount || C1->tripCount != C2->tripCount || !L1->isInnermost() || !L2->isInnermost()){
+        return false;
+    }
+
+    ICmpInst *L1Test = getHeaderExitTest(L1);
+    ICmpInst *L2Test = getHeaderExitTest(L2);
+    if (!L1Test || !L2Test || L1Test->getPredicate() != L2Test->getPredicate() ||
+        (L1Test->getPredicate() != ICmpInst::ICMP_SLT && L1Test->getPredicate() != ICmpInst::ICMP_ULT)){
+        return false;
+    }
+
+    for (Loop *L : {L1, L2}) {
+        if (std::next(L->getHeader()->phis().begin()) != L->getHeader()->phis().end()){
+            return false;
+        }
+        if (!SE.isLoopInvariant(SE.getSCEV(getHeaderExitTest(L)->getOperand(1)), L)){
+            return false;
+        }
+        for (BasicBlock *BB : L->blocks()) {
+            for (Instruction &I : *BB) {
+                for (User *U : I.users()) {
+                    if (!L->contains(cast<Instruction>(U))){
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//insert before L a copy of it that runs the iterations below Bound. L is then entered from a new preheader
+Loop *cloneShiftPrologue(Loop *L, ICmpInst *Compare, Value *Bound, DomTreeUpdater &DTU, LoopInfo &LI, Function &F) {
+    BasicBlock *header = L->getHeader();
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *exit = L->getExitBlock();
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock*, 8> blocks;
+    for (BasicBlock *BB : L->blocks()) {
+        BasicBlock *newBB = CloneBasicBlock(BB, VMap, ".shift", &F);
+        VMap[BB] = newBB;
+        blocks.push_back(newBB);
+    }
+    remapInstructionsInBlocks(blocks, VMap);
+
+    BasicBlock *newHeader = cast<BasicBlock>(VMap[header]);
+    BasicBlock *entry = BasicBlock::Create(F.getContext(), "shift.preheader", &F, newHeader);
+    BranchInst::Create(newHeader, entry);
+    BasicBlock *newPreheader = BasicBlock::Create(F.getContext(), "shift.exit", &F, header);
+    BranchInst::Create(header, newPreheader);
+
+    //the copy runs the first iterations, then leaves to L
+    for (PHINode &phi : newHeader->phis()) {
+        phi.replaceIncomingBlockWith(preheader, entry);
+    }
+    cast<ICmpInst>(VMap[Compare])->setOperand(1, Bound);
+    newHeader->getTerminator()->replaceUsesOfWith(exit, newPreheader);
+    for (PHINode &phi : header->phis()) {
+        phi.replaceIncomingBlockWith(preheader, newPreheader);
+    }
+
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    updates.push_back({DominatorTree::Insert, entry, newHeader});
+    updates.push_back({DominatorTree::Insert, newPreheader, header});
+    for (BasicBlock *BB : blocks) {
+        for (BasicBlock *Succ : successors(BB)){
+            updates.push_back({DominatorTree::Insert, BB, Succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+    updateTerminator(preheader, DTU, [&]() {
+        preheader->getTerminator()->replaceUsesOfWith(header, entry);
+    });
+
+    Loop *prologue = LI.AllocateLoop();
+    if (Loop *parent = L->getParentLoop()){
+        parent->addChildLoop(prologue);
+        parent->addBasicBlockToLoop(entry, LI);
+        parent->addBasicBlockToLoop(newPreheader, LI);
+    }else{
+        LI.addTopLevelLoop(prologue);
+    }
+    for (BasicBlock *BB : L->blocks()){
+        prologue->addBasicBlockToLoop(cast<BasicBlock>(VMap[BB]), LI);
+    }
+    return prologue;
+}
+
+//delay L2 by Shift iterations, so that each iteration of the fused loop runs the iteration i + Shift of L1
+//and the iteration i of L2. The first Shift iterations of L1 run in a copy placed before it, and the last
+//Shift iterations of L2 in a copy placed after it
+bool shiftLoops(fusionCandidate *C1, fusionCandidate *C2, int64_t Shift, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, ScalarEvolution &SE, addRecCache &AddRecs, Function &F) {
+    Loop *L1 = C1->loop;
+    Loop *L2 = C2->loop;
+    ICmpInst *L1Compare = getHeaderExitTest(L1);
+    ICmpInst *L2Compare = getHeaderExitTest(L2);
+    Value *L1Bound = L1Compare->getOperand(1);
+    Value *L2Bound = L2Compare->getOperand(1);
+    bool isSigned = L1Compare->isSigned();
+
+    //the prologue runs up to min(bound, Shift), the shifted loops up to max(bound, Shift) - Shift, without wrapping
+    const SCEV *shift = SE.getConstant(L1Bound->getType(), Shift);
+    const SCEV *L1Low = isSigned ? SE.getSMinExpr(SE.getSCEV(L1Bound), shift) : SE.getUMinExpr(SE.getSCEV(L1Bound), shift);
+    auto getShiftedBound = [&](Value *Bound) {
+        const SCEV *bound = SE.getSCEV(Bound);
+        return SE.getMinusSCEV(isSigned ? SE.getSMaxExpr(bound, shift) : SE.getUMaxExpr(bound, shift), shift);
+    };
+    const SCEV *L1High = getShiftedBound(L1Bound);
+    const SCEV *L2High = getShiftedBound(L2Bound);
+
+    Instruction *L1InsertPoint = L1->getLoopPreheader()->getTerminator();
+    Instruction *L2InsertPoint = L2->getLoopPreheader()->getTerminator();
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "shift");
+    if (!Expander.isSafeToExpandAt(L1Low, L1InsertPoint) || !Expander.isSafeToExpandAt(L1High, L1InsertPoint) || !Expander.isSafeToExpandAt(L2High, L2InsertPoint)){
+        return false;
+    }
+    Value *L1Prologue = Expander.expandCodeFor(L1Low, L1Bound->getType(), L1InsertPoint);
+    Value *L1Shifted = Expander.expandCodeFor(L1High, L1Bound->getType(), L1InsertPoint);
+    Value *L2Shifted = Expander.expandCodeFor(L2High, L2Bound->getType(), L2InsertPoint);
+
+    forgetLoop(L1, SE, AddRecs);
+    forgetLoop(L2, SE, AddRecs);
+
+    DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+    cloneShiftPrologue(L1, L1Compare, L1Prologue, DTU, LI, F);
+
+    //the body of L1 sees its index Shift iterations ahead, the exit test and the increment still count from 0
+    PHINode *index = L1->getCanonicalInductionVariable();
+    Value *increment = index->getIncomingValueForBlock(L1->getLoopLatch());
+    BinaryOperator *shifted = BinaryOperator::CreateAdd(index, ConstantInt::get(index->getType(), Shift), "shift.index", L1->getHeader()->getFirstNonPHI());
+    if (isSigned){
+        shifted->setHasNoSignedWrap();
+    }else{
+        shifted->setHasNoUnsignedWrap();
+    }
+    index->replaceUsesWithIf(shifted, [&](Use &U) {
+        return U.getUser() != shifted && U.getUser() != increment && U.getUser() != L1Compare;
+    });
+    L1Compare->setOperand(1, L1Shifted);
+
+    L2Compare->setOperand(1, L2Shifted);
+    cloneRemainderLoop(L2, L2, L2Compare, L2Bound, DTU, LI, F);
+    DTU.flush();
+
+    C1->tripCount = SE.getExitCount(L1, L1->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    C2->tripCount = SE.getExitCount(L2, L2->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+
+    if (VerifyDomTrees){
+        verifyAnalysisInfo(F, DT, PDT);
+    }
+    return true;
+}
+
+//compute the range of addresses L accesses through the bucket of Object when it takes tripCount backedges.
+//The no-wrap assumptions needed to see the addresses as affine recurrences are added to predicates
+bool getAccessRange(Loop *L, const Value *Object, accessBuckets &buckets, const SCEV *tripCount, ScalarEvolution &SE, const DataLayout &DL, accessRange &range, SmallPtrSetImpl<const SCEVPredicate*> &predicates) {
+    if (isa<SCEVCouldNotCompute>(tripCount)){
+        return false;
+    }
+
+    Type *IntPtrTy = DL.getIntPtrType(Object->getType());
+    accessBucket &bucket = buckets[Object];
+    range = {nullptr, nullptr};
+    for (auto *accesses : {&bucket.reads, &bucket.writes}) {
+        for (Instruction *I : *accesses) {
+            const SCEV *address = SE.getSCEV(getLoadStorePointerOperand(I));
+            const SCEV *first = address;
+            const SCEV *last = address;
+
+            //the address of an affine recurrence is at one end of the range in the first iteration and at the other in the last one
+            if (!SE.isLoopInvariant(address, L)) {
+                const SCEVAddRecExpr *rec = dyn_cast<SCEVAddRecExpr>(address);
+                if (!rec){
+                    rec = SE.convertSCEVToAddRecWithPredicates(address, L, predicates);
+                }
+                const SCEV *lastIteration = getLastIteration(L, I, tripCount, IntPtrTy, SE);
+                if (!rec || rec->getLoop() != L || !rec->isAffine() || !lastIteration){
+                    return false;
+                }
+                first = rec->getStart();
+                last = SE.getAddExpr(first, SE.getMulExpr(rec->getStepRecurrence(SE), lastIteration));
+            }
+
+            first = SE.getPtrToIntExpr(first, IntPtrTy);
+            last = SE.getPtrToIntExpr(last, IntPtrTy);
+            if (isa<SCEVCouldNotCompute>(first) || isa<SCEVCouldNotCompute>(last)){
+                return false;
+            }
+
+            const SCEV *low = SE.getUMinExpr(first, last);
+            const SCEV *high = SE.getAddExpr(SE.getUMaxExpr(first, last), SE.getConstant(IntPtrTy, getAccessSize(I, DL)));
+            range.low = range.low ? SE.getUMinExpr(range.low, low) : low;
+            range.high = range.high ? SE.getUMaxExpr(range.high, high) : high;
+        }
+    }
+    return range.low && range.high;
+}
+
+//compute the ranges of the pairs of objects to check before fusing C1 and C2, and make sure they can be expanded
+//where the checks are emitted: before the checks that already guard C1, if any, or at the end of its preheader
+bool getCheckedRanges(fusionCandidate *C1, fusionCandidate *C2, ArrayRef<std::pair<const Value*, const Value*>> checks, accessBuckets &L1Buckets, accessBuckets &L2Buckets, ScalarEvolution &SE, const DataLayout &DL, SmallVectorImpl<std::pair<accessRange, accessRange>> &ranges, SmallPtrSetImpl<const SCEVPredicate*> &predicates) {
+    Instruction *insertPoint = C1->aliasCheck ? C1->aliasCheck : C1->loop->getLoopPreheader()->getTerminator();
+    SCEVExpander Expander(SE, DL, "fuse.rtcheck");
+    for (auto &check : checks) {
+        accessRange L1Range, L2Range;
+        if (!getAccessRange(C1->loop, check.first, L1Buckets, C1->tripCount, SE, DL, L1Range, predicates) ||
+            !getAccessRange(C2->loop, check.second, L2Buckets, C2->tripCount, SE, DL, L2Range, predicates)){
+            return false;
+        }
+        for (const SCEV *S : {L1Range.low, L1Range.high, L2Range.low, L2Range.high}) {
+            if (!Expander.isSafeToExpandAt(S, insertPoint)){
+                return false;
+            }
+        }
+        ranges.push_back({L1Range, L2Range});
+    }
+
+    //a no-wrap assumption is checked through the start, the step and the backedge taken count of its recurrence
+    for (const SCEVPredicate *P : predicates) {
+        const SCEVWrapPredicate *wrap = dyn_cast<SCEVWrapPredicate>(P);
+        if (!wrap){
+            return false;
+        }
+        const SCEVAddRecExpr *rec = cast<SCEVAddRecExpr>(wrap->getExpr());
+        const SCEV *backedgeTakenCount = SE.getBackedgeTakenCount(rec->getLoop());
+        if (isa<SCEVCouldNotCompute>(backedgeTakenCount)){
+            return false;
+        }
+        for (const SCEV *S : {rec->getStart(), rec->getStepRecurrence(SE), backedgeTakenCount}) {
+            if (!Expander.isSafeToExpandAt(S, insertPoint)){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//the unfused copies of L1 and L2 share the blocks after L2 with the fused loop: none of their values may be used there.
+//A loop that is already versioned has no preheader anymore, its checks are extended instead
+bool canVersionLoops(fusionCandidate *C1, Loop *L2) {
+    Loop *L1 = C1->loop;
+    if (!L1->isInnermost() || !L2->isInnermost() || (!C1->aliasCheck && !L1->getLoopPreheader()) || !L2->getExitBlock() ||
+        L1->getExitBlock() != L2->getLoopPreheader()){
+        return false;
+    }
+
+    for (Loop *L : {L1, L2}) {
+        for (BasicBlock *BB : L->blocks()) {
+            for (Instruction &I : *BB) {
+                for (User *U : I.users()) {
+                    if (!L->contains(cast<Instruction>(U))){
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//clone L, preceded by Before if not null, for the unfused path of a versioned fusion. The copy is registered
+//in LoopInfo next to L and its edges are queued in DTU; the edges entering it are left to the caller
+Loop *cloneForFallback(Loop *L, BasicBlock *Before, ValueToValueMapTy &VMap, DomTreeUpdater &DTU, LoopInfo &LI, Function &F) {
+    SmallVector<BasicBlock*, 8> blocks;
+    if (Before){
+        blocks.push_back(Before);
+    }
+    blocks.append(L->blocks().begin(), L->blocks().end());
+
+    SmallVector<BasicBlock*, 8> newBlocks;
+    for (BasicBlock *BB : blocks) {
+        BasicBlock *newBB = CloneBasicBlock(BB, VMap, ".nofuse", &F);
+        VMap[BB] = newBB;
+        newBlocks.push_back(newBB);
+    }
+    remapInstructionsInBlocks(newBlocks, VMap);
+
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    for (BasicBlock *BB : newBlocks) {
+        for (BasicBlock *Succ : successors(BB)){
+            updates.push_back({DominatorTree::Insert, BB, Succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+
+    //the exits of L are shared by the copy and get the same incoming values from it
+    SmallVector<BasicBlock*, 4> exits;
+    L->getUniqueExitBlocks(exits);
+    for (BasicBlock *exit : exits) {
+        for (PHINode &phi : exit->phis()) {
+            for (BasicBlock *BB : L->blocks()) {
+                if (phi.getBasicBlockIndex(BB) >= 0){
+                    phi.addIncoming(phi.getIncomingValueForBlock(BB), cast<BasicBlock>(VMap[BB]));
+                }
+            }
+        }
+    }
+
+    Loop *copy = LI.AllocateLoop();
+    if (Loop *parent = L->getParentLoop()){
+        parent->addChildLoop(copy);
+        if (Before){
+            parent->addBasicBlockToLoop(cast<BasicBlock>(VMap[Before]), LI);
+        }
+    }else{
+        LI.addTopLevelLoop(copy);
+    }
+    for (BasicBlock *BB : L->blocks()){
+        copy->addBasicBlockToLoop(cast<BasicBlock>(VMap[BB]), LI);
+    }
+    return copy;
+}
+
+//keep a copy of L1 and L2 that is taken when any of the checked ranges overlap, so that the originals can be fused.
+//The first time C1 is versioned the copy of L1 is entered from its preheader; then the copy of each loop fused
+//into C1 is appended to the unfused path, which always rejoins the fused one at the exit of C1
+void versionLoops(fusionCandidate *C1, Loop *L2, ArrayRef<std::pair<accessRange, accessRange>> ranges, const SmallPtrSetImpl<const SCEVPredicate*> &predicates, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, ScalarEvolution &SE, Function &F) {
+    Loop *L1 = C1->loop;
+    DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+
+    if (!C1->aliasCheck) {
+        BasicBlock *preheader = L1->getLoopPreheader();
+        ValueToValueMapTy VMap;
+        cloneForFallback(L1, nullptr, VMap, DTU, LI, F);
+        BranchInst *check = BranchInst::Create(cast<BasicBlock>(VMap[L1->getHeader()]), L1->getHeader(), ConstantInt::getFalse(F.getContext()));
+        updateTerminator(preheader, DTU, [&]() {
+            ReplaceInstWithInst(preheader->getTerminator(), check);
+        });
+        C1->aliasCheck = check;
+    }
+
+    //the unfused path leaves through the block between L1 and L2, move it to a copy of that block and of L2
+    BasicBlock *L2_preheader = L2->getLoopPreheader();
+    SmallVector<BasicBlock*, 4> fallbackExits;
+    for (BasicBlock *pred : predecessors(L2_preheader)) {
+        if (!L1->contains(pred)){
+            fallbackExits.push_back(pred);
+        }
+    }
+    ValueToValueMapTy VMap;
+    cloneForFallback(L2, L2_preheader, VMap, DTU, LI, F);
+    BasicBlock *newPreheader = cast<BasicBlock>(VMap[L2_preheader]);
+    for (BasicBlock *pred : fallbackExits) {
+        updateTerminator(pred, DTU, [&]() {
+            pred->getTerminator()->replaceUsesOfWith(L2_preheader, newPreheader);
+        });
+    }
+
+    //take the unfused path if any pair of ranges overlaps, or if an address the ranges are based on wraps
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    SCEVExpander Expander(SE, DL, "fuse.rtcheck");
+    IRBuilder<> Builder(C1->aliasCheck);
+    Value *conflict = C1->aliasCheck->getCondition();
+    auto addConflict = [&](Value *V) {
+        conflict = isa<Constant>(conflict) ? V : Builder.CreateOr(V, conflict, "fuse.conflict");
+    };
+    for (auto &check : ranges) {
+        Value *L1Low = Expander.expandCodeFor(check.first.low, check.first.low->getType(), C1->aliasCheck);
+        Value *L1High = Expander.expandCodeFor(check.first.high, check.first.high->getType(), C1->aliasCheck);
+        Value *L2Low = Expander.expandCodeFor(check.second.low, check.second.low->getType(), C1->aliasCheck);
+        Value *L2High = Expander.expandCodeFor(check.second.high, check.second.high->getType(), C1->aliasCheck);
+        Value *overlap = Builder.CreateAnd(Builder.CreateICmpULT(L1Low, L2High), Builder.CreateICmpULT(L2Low, L1High), "fuse.overlap");
+        addConflict(overlap);
+    }
+    for (const SCEVPredicate *P : predicates) {
+        addConflict(Expander.expandCodeForPredicate(P, C1->aliasCheck));
+    }
+    C1->aliasCheck->setCondition(conflict);
+    C1->numChecks += ranges.size() + predicates.size();
+
+    DTU.flush();
+    if (VerifyDomTrees){
+        verifyAnalysisInfo(F, DT, PDT);
+    }
+}
+
+//replace the loads of the fused loop L that read the value stored earlier in the same iteration, i.e. at a
+//zero distance, with the stored value. The body is walked in execution order along the blocks that can only
+//be entered from the previous one, and a store stays available until a write that may alias it
+unsigned forwardStoresToLoads(Loop *L, ScalarEvolution &SE, AAResults &AA) {
+    unsigned forwarded = 0;
+    SmallVector<std::pair<const SCEV*, StoreInst*>, 8> available;
+
+    BasicBlock *BB = L->getHeader();
+    while (BB) {
+        for (Instruction &I : make_early_inc_range(*BB)) {
+            if (auto *Load = dyn_cast<LoadInst>(&I)){
+                if (!Load->isSimple()){
+                    available.clear();
+                    continue;
+                }
+                //the same address SCEV has the same start and stride, so the distance is zero
+                const SCEV *address = SE.getSCEV(Load->getPointerOperand());
+                for (auto &entry : available) {
+                    if (entry.first == address && entry.second->getValueOperand()->getType() == Load->getType()){
+                        LLVM_DEBUG(dbgs() << "Forwarding " << *entry.second << " to " << *Load << "\n");
+                        Load->replaceAllUsesWith(entry.second->getValueOperand());
+                        Value *pointer = Load->getPointerOperand();
+                        Load->eraseFromParent();
+                        //the address computation may be left without users, and keep a temporary array alive
+                        RecursivelyDeleteTriviallyDeadInstructions(pointer);
+                        ++forwarded;
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            if (auto *Store = dyn_cast<StoreInst>(&I)){
+                if (Store->isSimple()){
+                    MemoryLocation location = MemoryLocation::get(Store);
+                    erase_if(available, [&](std::pair<const SCEV*, StoreInst*> &entry) {
+                        return !AA.isNoAlias(MemoryLocation::get(entry.second), location);
+                    });
+                    available.push_back({SE.getSCEV(Store->getPointerOperand()), Store});
+                    continue;
+                }
+            }
+
+            if (I.mayWriteToMemory()){
+                available.clear();
+            }
+        }
+
+        //continue with the only successor in the loop body, if BB is the only way to reach it
+        BasicBlock *next = nullptr;
+        for (BasicBlock *Succ : successors(BB)) {
+            if (!L->contains(Succ)){
+                continue;
+            }
+            if (next || Succ == L->getHeader()){
+                next = nullptr;
+                break;
+            }
+            next = Succ;
+        }
+        BB = next && next->getSinglePredecessor() == BB ? next : nullptr;
+    }
+    return forwarded;
+}
+
+//collect the stores to Object, an array local to the function, and fail if anything else uses it
+bool collectDeadStores(Value *Object, SmallVectorImpl<Instruction*> &stores) {
+    for (User *U : Object->users()) {
+        auto *I = cast<Instruction>(U);
+        if (isa<GetElementPtrInst>(I) || isa<BitCastInst>(I)){
+            if (!collectDeadStores(I, stores)){
                 return false;
             }
-        }  
+        } else if (auto *Store = dyn_cast<StoreInst>(I)){
+            if (Store->getValueOperand() == Object || !Store->isSimple()){
+                return false;
+            }
+            stores.push_back(Store);
+        } else if (I->isLifetimeStartOrEnd()){
+            stores.push_back(I);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+//collect the loads and stores of Object, an array local to the function, and its lifetime markers. They are a single
+//element per iteration if all the loads and stores are in L, at the same affine address with a constant stride:
+//an element is then written and read by one iteration only, and its type is returned in ElementType
+bool collectElementAccesses(Value *Object, Loop *L, ScalarEvolution &SE, SmallVectorImpl<Instruction*> &accesses, SmallVectorImpl<Instruction*> &markers, Type *&ElementType) {
+    for (User *U : Object->users()) {
+        auto *I = cast<Instruction>(U);
+        if (isa<GetElementPtrInst>(I) || isa<BitCastInst>(I)){
+            if (!collectElementAccesses(I, L, SE, accesses, markers, ElementType)){
+                return false;
+            }
+            continue;
+        }
+        if (I->isLifetimeStartOrEnd()){
+            markers.push_back(I);
+            continue;
+        }
+
+        Value *pointer = getLoadStorePointerOperand(I);
+        if (pointer != Object || !L->contains(I) || (isa<StoreInst>(I) && !cast<StoreInst>(I)->isSimple()) ||
+            (isa<LoadInst>(I) && !cast<LoadInst>(I)->isSimple())){
+            return false;
+        }
+        Type *type = getLoadStoreType(I);
+        const SCEVAddRecExpr *address = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(pointer));
+        const SCEVConstant *step = address ? dyn_cast<SCEVConstant>(address->getStepRecurrence(SE)) : nullptr;
+        if (!address || address->getLoop() != L || !address->isAffine() || !step || step->isZero() ||
+            (ElementType && type != ElementType) ||
+            (!accesses.empty() && SE.getSCEV(getLoadStorePointerOperand(accesses.front())) != address)){
+            return false;
+        }
+        ElementType = type;
+        accesses.push_back(I);
+    }
+    return true;
+}
+
+//check that every path from the start of the iteration to Load stores to the element first, so that no load
+//sees what an earlier run of the loop left in the array
+bool isStoredBeforeLoad(LoadInst *Load, Loop *L, ArrayRef<Instruction*> accesses) {
+    SmallPtrSet<BasicBlock*, 8> storing;
+    for (Instruction *I : accesses) {
+        if (isa<StoreInst>(I)){
+            storing.insert(I->getParent());
+        }
+    }
+    for (Instruction *I = Load->getPrevNode(); I; I = I->getPrevNode()) {
+        if (isa<StoreInst>(I) && is_contained(accesses, I)){
+            return true;
+        }
+    }
+
+    SmallVector<BasicBlock*, 8> worklist;
+    SmallPtrSet<BasicBlock*, 8> visited;
+    worklist.push_back(Load->getParent());
+    while (!worklist.empty()) {
+        BasicBlock *BB = worklist.pop_back_val();
+        if (BB == L->getHeader()){
+            return false;
+        }
+        for (BasicBlock *Pred : predecessors(BB)) {
+            if (L->contains(Pred) && !storing.count(Pred) && visited.insert(Pred).second){
+                worklist.push_back(Pred);
+            }
+        }
+    }
+    return true;
+}
+
+//replace Array with a scalar that holds the element of the current iteration, and promote it to a register
+void replaceWithScalar(AllocaInst *Array, Type *ElementType, ArrayRef<Instruction*> accesses, ArrayRef<Instruction*> markers, DominatorTree &DT, AssumptionCache &AC) {
+    AllocaInst *scalar = new AllocaInst(ElementType, Array->getType()->getAddressSpace(), Array->getName() + ".scalar", Array);
+    SmallVector<WeakTrackingVH, 16> operands;
+    for (Instruction *I : accesses) {
+        unsigned index = isa<LoadInst>(I) ? LoadInst::getPointerOperandIndex() : StoreInst::getPointerOperandIndex();
+        operands.push_back(I->getOperand(index));
+        I->setOperand(index, scalar);
+    }
+    for (Instruction *I : markers) {
+        operands.append(I->op_begin(), I->op_end());
+        I->eraseFromParent();
+    }
+    //the array goes away with the last address computed from it
+    operands.push_back(Array);
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(operands);
+    PromoteMemToReg({scalar}, DT, &AC);
+}
+
+//after the loads have been forwarded, the local arrays written by L that are never read are temporaries:
+//their stores are deleted, together with the arrays. The ones whose elements are produced and consumed
+//in the same iteration of L are replaced with a scalar. Returns the number of arrays removed or replaced
+unsigned contractTemporaryArrays(Loop *L, ScalarEvolution &SE, addRecCache &AddRecs, DominatorTree &DT, AssumptionCache &AC, OptimizationRemarkEmitter &ORE) {
+    SmallSetVector<AllocaInst*, 4> arrays;
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (auto *Store = dyn_cast<StoreInst>(&I)){
+                if (auto *Array = dyn_cast<AllocaInst>(getUnderlyingObject(Store->getPointerOperand()))){
+                    arrays.insert(Array);
+                }
+            }
+        }
+    }
+
+    unsigned contracted = 0;
+    for (AllocaInst *Array : arrays) {
+        SmallVector<Instruction*, 8> stores;
+        if (!collectDeadStores(Array, stores)){
+            SmallVector<Instruction*, 8> accesses;
+            SmallVector<Instruction*, 4> markers;
+            Type *elementType = nullptr;
+            if (!collectElementAccesses(Array, L, SE, accesses, markers, elementType) ||
+                any_of(accesses, [&](Instruction *I) { return isa<LoadInst>(I) && !isStoredBeforeLoad(cast<LoadInst>(I), L, accesses); })){
+                continue;
+            }
+
+            LLVM_DEBUG(dbgs() << "Replacing the temporary array " << *Array << " with a scalar\n");
+            ORE.emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "Contracted", L->getStartLoc(), L->getHeader())
+                       << "replaced the temporary array " << ore::NV("Array", Array->getName()) << " of the fused loop with a scalar";
+            });
+            replaceWithScalar(Array, elementType, accesses, markers, DT, AC);
+            forgetLoop(L, SE, AddRecs);
+            ++contracted;
+            continue;
+        }
+
+        LLVM_DEBUG(dbgs() << "Removing the temporary array " << *Array << "\n");
+        ORE.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Contracted", L->getStartLoc(), L->getHeader())
+                   << "removed the temporary array " << ore::NV("Array", Array->getName()) << " of the fused loop";
+        });
+        SmallVector<WeakTrackingVH, 16> operands;
+        for (Instruction *I : stores) {
+            operands.append(I->op_begin(), I->op_end());
+            I->eraseFromParent();
+        }
+        RecursivelyDeleteTriviallyDeadInstructionsPermissive(operands);
+        ++contracted;
+    }
+    return contracted;
+}
+
+//the fused body may now read in the same iteration what it has just written
+void cleanUpFusedLoop(Loop *L, ScalarEvolution &SE, AAResults &AA, addRecCache &AddRecs, DominatorTree &DT, AssumptionCache &AC, OptimizationRemarkEmitter &ORE) {
+    if (unsigned forwarded = forwardStoresToLoads(L, SE, AA)){
+        NumForwardedLoads += forwarded;
+        ORE.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Forwarded", L->getStartLoc(), L->getHeader())
+                   << ore::NV("Loads", forwarded) << " loads replaced by the value stored in the same iteration";
+        });
+    }
+    NumContractedArrays += contractTemporaryArrays(L, SE, AddRecs, DT, AC, ORE);
+}
+
+//mark the accesses of an innermost fused loop as parallel if none of their dependences is carried by the loop:
+//fusion only proved that no dependence between the loops is reversed, the vectorizer can now skip its own analysis
+bool markParallelAccesses(Loop *L, DependenceInfo &DI) {
+    if (!L->isInnermost()){
+        return false;
+    }
+
+    SmallVector<Instruction*, 16> accesses;
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (!I.mayReadOrWriteMemory()){
+                continue;
+            }
+            if (!isa<LoadInst>(I) && !isa<StoreInst>(I)){
+                return false;
+            }
+            accesses.push_back(&I);
+        }
+    }
+    uint64_t writes = count_if(accesses, [](Instruction *I) { return I->mayWriteToMemory(); });
+    if (accesses.empty() || writes * accesses.size() > MaxDependenceQueries){
+        return false;
+    }
+
+    unsigned depth = L->getLoopDepth();
+    for (unsigned i = 0; i < accesses.size(); ++i) {
+        for (unsigned j = i; j < accesses.size(); ++j) {
+            if (!accesses[i]->mayWriteToMemory() && !accesses[j]->mayWriteToMemory()){
+                continue;
+            }
+            ++NumDependenceQueries;
+            std::unique_ptr<Dependence> dependence = DI.depends(accesses[i], accesses[j], true);
+            if (dependence && dependence->getDirection(depth) != Dependence::DVEntry::EQ){
+                LLVM_DEBUG(dbgs() << "Loop-carried dependence between " << *accesses[i] << " and " << *accesses[j] << "\n");
+                return false;
+            }
+        }
+    }
+
+    LLVMContext &Ctx = L->getHeader()->getContext();
+    MDNode *group = MDNode::getDistinct(Ctx, {});
+    for (Instruction *I : accesses) {
+        I->setMetadata(LLVMContext::MD_access_group, uniteAccessGroups(I->getMetadata(LLVMContext::MD_access_group), group));
+    }
+    MDNode *parallel = MDNode::get(Ctx, {MDString::get(Ctx, "llvm.loop.parallel_accesses"), group});
+    L->setLoopID(makePostTransformationMetadata(Ctx, L->getLoopID(), {"llvm.loop.parallel_accesses"}, {parallel}));
+    return true;
+}
+
+//the trip count of a candidate is computed the first time it is needed
+const SCEV *getTripCount(fusionCandidate *C, ScalarEvolution &SE) {
+    if (!C->tripCount){
+        C->tripCount = SE.getExitCount(C->loop, C->loop->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    }
+    return C->tripCount;
+}
+
+//a trip count that SCEV cannot compute is not known to be equal to any other one
+bool haveSameTripCount(fusionCandidate *C1, fusionCandidate *C2, ScalarEvolution &SE) {
+    return getTripCount(C1, SE) == getTripCount(C2, SE) && !isa<SCEVCouldNotCompute>(C1->tripCount);
+}
+
+//how many times the body of L runs per entry in the function: the frequency of its predecessor times its trip count,
+//that is the profiled one when SCEV cannot compute it. Without a trip count, the frequency BlockFrequencyInfo
+//gives to the header
+uint64_t getHotness(Loop *L, BlockFrequencyInfo &BFI, ScalarEvolution &SE) {
+    BasicBlock *predecessor = L->getLoopPredecessor();
+    unsigned tripCount = SE.getSmallConstantTripCount(L);
+    if (!tripCount){
+        if (auto estimated = getLoopEstimatedTripCount(L)){
+            tripCount = *estimated;
+        }
+    }
+    if (!predecessor || !tripCount){
+        return BFI.getBlockFreq(L->getHeader()).getFrequency();
+    }
+    return SaturatingMultiply<uint64_t>(BFI.getBlockFreq(predecessor).getFrequency(), tripCount);
+}
+
+void reportMovedCode(Loop *L1, unsigned Moved, OptimizationRemarkEmitter &ORE) {
+    if (!Moved){
+        return;
+    }
+    NumMovedInstructions += Moved;
+    ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "MovedInterveningCode", L1->getStartLoc(), L1->getHeader())
+               << "moved " << ore::NV("MovedInstructions", Moved)
+               << " instructions out of the way to make the loops adjacent";
+    });
+}
+
+//check every fusion condition on C1 and C2, reporting why they cannot be fused, and fill Plan with what
+//fuseLoopPair needs to fuse them. The code between the loops stays moved only if they can be fused
+bool canFuseLoops(fusionCandidate *C1, fusionCandidate *C2, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, Function &F, FunctionAnalysisManager &AM, fusionPlan &Plan) {
+    Loop* L1 = C1->loop;
+    Loop* L2 = C2->loop;
+    ++NumFusionAttempts;
+
+    //code between the loops may be moved out of the way, it goes back where it was if the loops are not fused
+    SmallVector<Instruction*, 8> &movedInstructions = Plan.movedInstructions;
+    auto restoreMovedCode = make_scope_exit([&]() {
+        restoreInterveningCode(movedInstructions, L2);
+        movedInstructions.clear();
+    });
+    if (!areLoopsAdjacent(L1, L2) &&
+        !(moveInterveningCode(L1, L2, DT, PDT, DI, movedInstructions) && areLoopsAdjacent(L1, L2))) {
+        LLVM_DEBUG(dbgs() << "Loops are not adjacent \n");
+        ++NumNotAdjacent;
+        reportMissedFusion(L1, L2, "NotAdjacent", "not-adjacent", ORE);
+        return false;
+    }
+
+    LLVM_DEBUG(dbgs() << "Loops are adjacent \n");
+
+    // Get the trip counts using getExitCount
+    bool sameTripCount = haveSameTripCount(C1, C2, SE);
+
+    // Print the trip counts
+    LLVM_DEBUG(dbgs() << "Trip count of L1: " << *C1->tripCount << "\n");
+    LLVM_DEBUG(dbgs() << "Trip count of L2: " << *C2->tripCount << "\n");
+
+    // Check if both trip counts are equal, or differ by a few iterations that can be peeled
+    int64_t &peelCount = Plan.peelCount;
+    peelCount = 0;
+    if (!sameTripCount && !canPeelToCommonTripCount(C1, C2, SE, peelCount)) {
+        LLVM_DEBUG(dbgs() << "Loops have a different trip count \n");
+        ++NumTripCountMismatch;
+        reportMissedFusion(L1, L2, "TripCountMismatch", "trip-count-mismatch", ORE);
+        return false;
     }
-    
-    //if we reach this point, all the dependencies are non-negative
+
+    LLVM_DEBUG(dbgs() << "Loops have the same trip count, up to " << std::abs(peelCount) << " peeled iterations \n");
+
+    if (!nestsAllowFusion(L1, L2, SE)) {
+        ++NumNestMismatch;
+        reportMissedFusion(L1, L2, "NestMismatch", "nest-mismatch", ORE);
+        return false;
+    }
+
+    if (!canMergeLoops(L1, L2, DT, SE)) {
+        LLVM_DEBUG(dbgs() << "Loops cannot be merged \n");
+        ++NumNotMergeable;
+        reportMissedFusion(L1, L2, "NotMergeable", "not-mergeable", ORE);
+        return false;
+    }
+
+    //a versioned loop is entered through its alias checks, that lead to the unfused copy as well
+    BasicBlock *L1Entry = C1->aliasCheck ? C1->aliasCheck->getParent() : L1->getHeader();
+    if (!(DT.dominates(L1Entry, L2->getHeader()) && PDT.dominates(L2->getHeader(), L1Entry))) {
+        LLVM_DEBUG(dbgs() << "Loops are not control flow equivalent \n");
+        ++NumNotControlFlowEquivalent;
+        reportMissedFusion(L1, L2, "NotControlFlowEquivalent", "not-CFE", ORE);
+        return false;
+    }
+    LLVM_DEBUG(dbgs() << "Loops are control flow equivalent \n");
+
+    //collect load and store instructions of L1 and L2
+    accessBuckets &L1Buckets = Plan.L1Buckets;
+    accessBuckets &L2Buckets = Plan.L2Buckets;
+    collectAccessBuckets(L1, L1Buckets);
+    collectAccessBuckets(L2, L2Buckets);
+
+    if (countDependenceQueries(L1Buckets, L2Buckets, AA) > MaxDependenceQueries) {
+        LLVM_DEBUG(dbgs() << "Too many dependences to check \n");
+        ++NumBudgetStops;
+        reportMissedFusion(L1, L2, "TooManyDependenceQueries", "max-dependence-queries", ORE);
+        return false;
+    }
+
+    SmallVector<std::pair<const Value*, const Value*>, 4> checks;
+    int64_t &shift = Plan.shift;
+    shift = 0;
+    if (!dependencesAllowFusion(L1, L2, L1Buckets, L2Buckets, DT, SE, DI, AA, AddRecs, checks, shift) ||
+        (shift > 0 && (peelCount != 0 || !checks.empty() || C1->aliasCheck || !canShiftLoops(C1, C2, shift, SE)))) {
+        LLVM_DEBUG(dbgs() << "Loops are dependent \n");
+        ++NumNegativeDependence;
+        reportMissedFusion(L1, L2, "NegativeDependence", "negative-dependence", ORE);
+        return false;
+    }
+
+    LLVM_DEBUG(dbgs() << "Loops don't have any negative distance dependences, once L2 is delayed by " << shift << " iterations \n");
+
+    TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    fusionProfitability profitability = estimateProfitability(L1, L2, L1Buckets, L2Buckets, TTI, SE, AddRecs, F.getParent()->getDataLayout());
+    int64_t profit = profitability.savings - profitability.registerCost - profitability.vectorizationCost;
+    LLVM_DEBUG(dbgs() << "Savings: " << profitability.savings << ", register cost: " << profitability.registerCost
+                      << ", vectorization cost: " << profitability.vectorizationCost << " bytes per iteration \n");
+    ORE.emit([&]() {
+        return OptimizationRemarkAnalysis(DEBUG_TYPE, "Profitability", L1->getStartLoc(), L1->getHeader())
+               << "estimated savings " << ore::NV("Savings", profitability.savings)
+               << ", register cost " << ore::NV("RegisterCost", profitability.registerCost)
+               << ", vectorization cost " << ore::NV("VectorizationCost", profitability.vectorizationCost)
+               << " bytes per iteration";
+    });
+    if (profit <= FusionProfitThreshold) {
+        LLVM_DEBUG(dbgs() << "Fusion is not profitable \n");
+        ++NumNotProfitable;
+        reportMissedFusion(L1, L2, "NotProfitable", "not-profitable", ORE);
+        return false;
+    }
+
+    //the objects whose distance is unknown are checked at runtime, and the unfused loops are kept for when they overlap.
+    //Once C1 is versioned, every loop fused into it has to be copied to the unfused path, even without new checks
+    Plan.versioned = !checks.empty() || C1->aliasCheck;
+    if (Plan.versioned) {
+        LLVM_DEBUG(dbgs() << checks.size() << " runtime alias checks needed \n");
+        if (peelCount != 0 || !canVersionLoops(C1, L2) ||
+            !getCheckedRanges(C1, C2, checks, L1Buckets, L2Buckets, SE, F.getParent()->getDataLayout(), Plan.ranges, Plan.predicates) ||
+            C1->numChecks + Plan.ranges.size() + Plan.predicates.size() > MaxRuntimeChecks) {
+            LLVM_DEBUG(dbgs() << "Cannot version the loops \n");
+            ++NumNotVersioned;
+            reportMissedFusion(L1, L2, "NotVersioned", "runtime-checks", ORE);
+            return false;
+        }
+    }
+    LLVM_DEBUG(dbgs() << "All Loop Fusion conditions satisfied. \n");
+    restoreMovedCode.release();
     return true;
 }
 
-
-bool tryFuseLoops(fusionCandidate *C1, fusionCandidate *C2, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, LoopInfo &LI, Function &F, FunctionAnalysisManager &AM) {
+//peel, shift and version C1 and C2 as planned by canFuseLoops, then fuse them
+bool fuseLoopPair(fusionCandidate *C1, fusionCandidate *C2, fusionPlan &Plan, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, LoopInfo &LI, Function &F, FunctionAnalysisManager &AM) {
     Loop* L1 = C1->loop;
     Loop* L2 = C2->loop;
+    int64_t peelCount = Plan.peelCount;
+    int64_t shift = Plan.shift;
+    auto restoreMovedCode = make_scope_exit([&]() { restoreInterveningCode(Plan.movedInstructions, L2); });
+
+    if (peelCount != 0) {
+        if (!peelToCommonTripCount(C1, C2, peelCount, DT, PDT, LI, SE, AddRecs, F)) {
+            LLVM_DEBUG(dbgs() << "Cannot peel the extra iterations \n");
+            ++NumTripCountMismatch;
+            reportMissedFusion(L1, L2, "TripCountMismatch", "trip-count-mismatch", ORE);
+            return false;
+        }
+        ++NumPeeledLoops;
+        ORE.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Peeled", L1->getStartLoc(), L1->getHeader())
+                   << "peeled " << ore::NV("PeeledIterations", std::abs(peelCount))
+                   << " iterations off the " << (peelCount > 0 ? "first" : "second") << " loop to fuse it";
+        });
+    }
+
+    if (shift > 0) {
+        if (!shiftLoops(C1, C2, shift, DT, PDT, LI, SE, AddRecs, F)) {
+            LLVM_DEBUG(dbgs() << "Cannot shift the loops \n");
+            ++NumNegativeDependence;
+            reportMissedFusion(L1, L2, "NegativeDependence", "negative-dependence", ORE);
+            return false;
+        }
+        ++NumShiftedLoops;
+        ORE.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Shifted", L1->getStartLoc(), L1->getHeader())
+                   << "delayed the second loop by " << ore::NV("ShiftedIterations", shift)
+                   << " iterations to fuse it past a negative distance dependence";
+        });
+    }
+
+    //from here on the loops are fused
+    restoreMovedCode.release();
+    reportMovedCode(L1, Plan.movedInstructions.size(), ORE);
+
+    if (Plan.versioned) {
+        versionLoops(C1, L2, Plan.ranges, Plan.predicates, DT, PDT, LI, SE, F);
+        ++NumVersionedFusions;
+        ORE.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Versioned", L1->getStartLoc(), L1->getHeader())
+                   << "fused loops guarded by " << ore::NV("RuntimeChecks", C1->numChecks)
+                   << " runtime alias checks, the unfused loops are kept for when they fail";
+        });
+    }
+
+    //L2 is erased by fuseLoops, take its location first
+    DebugLoc L2Loc = L2->getStartLoc();
+    fuseLoops({L1, L2}, DT, PDT, LI, F, DI, SE, AddRecs, AM);
+
+    LLVM_DEBUG(dbgs() << "The code has been transformed. \n");
+    ++NumFusedLoops;
+    ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Fused", L1->getStartLoc(), L1->getHeader())
+               << "loop fused with the loop at " << ore::NV("SecondLoop", L2Loc);
+    });
+
+    cleanUpFusedLoop(L1, SE, AA, AddRecs, DT, AM.getResult<AssumptionAnalysis>(F), ORE);
+    NumParallelLoops += markParallelAccesses(L1, DI);
+    return true;
+}
+
+//check if C2 can join the run of candidates that fuseCandidateSet merges in a single rewrite.
+//Only the loops that fuse as they are join a run: the ones that need peeling, shifting or runtime checks
+//are left to canFuseLoops, that also reports why a pair cannot be fused. RunBuckets holds the accesses
+//of each loop of the run and AllBuckets all of them; C2's ones are added when it joins
+bool canExtendRun(ArrayRef<fusionCandidate*> Run, fusionCandidate *C2, SmallVectorImpl<accessBuckets> &RunBuckets, accessBuckets &AllBuckets, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, Function &F, FunctionAnalysisManager &AM) {
+    SmallVector<Loop*, 4> loops;
+    for (fusionCandidate *C : Run) {
+        loops.push_back(C->loop);
+    }
+    Loop *L1 = Run.front()->loop;
+    Loop *L2 = C2->loop;
+    ++NumFusionAttempts;
 
-    if (!areLoopsAdjacent(L1->getOutermostLoop(), L2->getOutermostLoop ())) {
-        outs() << "Loops are not adjacent \n";
+    //a versioned loop has to copy every loop fused into it to its unfused path
+    if (Run.front()->aliasCheck){
         return false;
     }
 
-    outs() << "Loops are adjacent \n";
+    SmallVector<Instruction*, 8> movedInstructions;
+    auto restoreMovedCode = make_scope_exit([&]() { restoreInterveningCode(movedInstructions, L2); });
+    bool adjacent = areLoopsAdjacent(loops.back(), L2) ||
+                    (moveInterveningCode(loops, L2, DT, PDT, DI, movedInstructions) && areLoopsAdjacent(loops.back(), L2));
+    if (!adjacent || !haveSameTripCount(Run.front(), C2, SE) || !nestsAllowFusion(L1, L2, SE) ||
+        !canMergeLoops(loops, L2, DT, SE) || !controlFlowEquivalent(L1, L2, DT, PDT)){
+        return false;
+    }
 
-    // Get the trip counts using getExitCount
-    if(!C1->tripCount){
-        const SCEV *tripCountL1 = SE.getExitCount(L1, L1->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
-        C1->tripCount = tripCountL1;
+    //L2 must not run any iteration before an iteration of a loop of the run it depends on
+    accessBuckets L2Buckets;
+    collectAccessBuckets(L2, L2Buckets);
+    for (unsigned k = 0; k < loops.size(); ++k) {
+        SmallVector<std::pair<const Value*, const Value*>, 4> checks;
+        int64_t shift = 0;
+        if (countDependenceQueries(RunBuckets[k], L2Buckets, AA) > MaxDependenceQueries ||
+            !dependencesAllowFusion(loops[k], L2, RunBuckets[k], L2Buckets, DT, SE, DI, AA, AddRecs, checks, shift) ||
+            !checks.empty() || shift > 0){
+            return false;
+        }
     }
-    
-    if(!C2->tripCount){
-        const SCEV *tripCountL2 = SE.getExitCount(L2, L2->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
-        C2->tripCount = tripCountL2;
+
+    TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    fusionProfitability profitability = estimateProfitability(loops, L2, AllBuckets, L2Buckets, TTI, SE, AddRecs, F.getParent()->getDataLayout());
+    if (profitability.savings - profitability.registerCost - profitability.vectorizationCost <= FusionProfitThreshold){
+        return false;
     }
-    
 
-    // Print the trip counts
-    outs() << "Trip count of L1: ";
-    C1->tripCount->print(outs());
-    outs() << "\n";
+    restoreMovedCode.release();
+    reportMovedCode(L1, movedInstructions.size(), ORE);
+    collectAccessBuckets(L2, AllBuckets);
+    RunBuckets.push_back(std::move(L2Buckets));
+    return true;
+}
+
+//group sibling candidates into control flow equivalent sets, each one ordered by dominance
+std::vector<fusionCandidateSet> collectCandidateSets(ArrayRef<fusionCandidate*> candidates, DominatorTree &DT, PostDominatorTree &PDT) {
+    std::vector<fusionCandidateSet> sets;
+    for (fusionCandidate *C : candidates){
+        //the candidates come in program order, so the last loop of a set dominates C
+        auto it = find_if(sets, [&](const fusionCandidateSet &set) {
+            Loop *last = set.back()->loop;
+            return last->getParentLoop() == C->loop->getParentLoop() && controlFlowEquivalent(last, C->loop, DT, PDT);
+        });
+        if (it == sets.end()){
+            sets.emplace_back();
+            it = std::prev(sets.end());
+        }
+        it->push_back(C);
+    }
+    return sets;
+}
+
+//report that a compile-time limit stopped the fusion at L, with the limit as the reason
+void reportBudgetStop(Loop *L, StringRef Limit, OptimizationRemarkEmitter &ORE) {
+    ++NumBudgetStops;
+    ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "BudgetExhausted", L->getStartLoc(), L->getHeader())
+               << "loop not fused: " << ore::NV("Reason", Limit);
+    });
+}
+
+//check if the time budget of the function has run out; the first time it does, the stop is reported at L
+bool isOverBudget(fusionBudget &Budget, Loop *L, OptimizationRemarkEmitter &ORE) {
+    if (!Budget.timedOut && TimeBudget && std::chrono::steady_clock::now() > Budget.deadline){
+        Budget.timedOut = true;
+        reportBudgetStop(L, "time-budget", ORE);
+    }
+    return Budget.timedOut;
+}
+
+//partition the set into groups of consecutive candidates that maximize the memory traffic saved by fusion.
+//The fusion graph has an edge between each pair of candidates, weighted by the bytes per iteration the second one
+//reuses from the first; an edge is fusion-preventing if the two loops can never be in the same fused loop, because of
+//their dependences, trip counts or nest shapes. Starting from one group per candidate, the two neighbouring groups
+//joined by the heaviest total weight and no fusion-preventing edge are merged, until no merge saves anything.
+//Returns the [begin, end) indices of each group
+SmallVector<std::pair<unsigned, unsigned>, 4> partitionCandidateSet(fusionCandidateSet &set, ScalarEvolution &SE, DominatorTree &DT, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, const DataLayout &DL, fusionBudget &Budget) {
+    unsigned size = set.size();
+    std::vector<accessBuckets> buckets(size);
+    for (unsigned k = 0; k < size; ++k) {
+        collectAccessBuckets(set[k]->loop, buckets[k]);
+        getTripCount(set[k], SE);
+    }
+
+    std::vector<std::vector<uint64_t>> weight(size, std::vector<uint64_t>(size, 0));
+    std::vector<std::vector<bool>> preventing(size, std::vector<bool>(size, false));
+    for (unsigned k = 0; k < size; ++k) {
+        //out of time, the loops left are not grouped with any other
+        if (isOverBudget(Budget, set[k]->loop, ORE)){
+            for (unsigned j = 0; j < size; ++j) {
+                preventing[std::min(j, k)][std::max(j, k)] = true;
+            }
+            continue;
+        }
+        for (unsigned j = k + 1; j < size; ++j) {
+            Loop *L1 = set[k]->loop;
+            Loop *L2 = set[j]->loop;
+            //only neighbours can be peeled or shifted to fuse them
+            int64_t peelCount = 0;
+            bool tripCountsMatch = haveSameTripCount(set[k], set[j], SE) ||
+                                   (j == k + 1 && canPeelToCommonTripCount(set[k], set[j], SE, peelCount));
+            SmallVector<std::pair<const Value*, const Value*>, 4> checks;
+            int64_t shift = 0;
+            preventing[k][j] = !tripCountsMatch || !nestsAllowFusion(L1, L2, SE) ||
+                               countDependenceQueries(buckets[k], buckets[j], AA) > MaxDependenceQueries ||
+                               !dependencesAllowFusion(L1, L2, buckets[k], buckets[j], DT, SE, DI, AA, AddRecs, checks, shift) ||
+                               (shift > 0 && j != k + 1);
+            weight[k][j] = getReuseBytes(buckets[k], buckets[j], DL);
+        }
+    }
+
+    SmallVector<std::pair<unsigned, unsigned>, 4> groups;
+    for (unsigned k = 0; k < size; ++k) {
+        groups.push_back({k, k + 1});
+    }
+    while (groups.size() > 1) {
+        unsigned best = 0;
+        uint64_t bestWeight = 0;
+        for (unsigned g = 0; g + 1 < groups.size(); ++g) {
+            uint64_t total = 0;
+            bool prevented = false;
+            for (unsigned k = groups[g].first; k < groups[g].second && !prevented; ++k) {
+                for (unsigned j = groups[g+1].first; j < groups[g+1].second; ++j) {
+                    prevented |= preventing[k][j];
+                    total += weight[k][j];
+                }
+            }
+            if (!prevented && total > bestWeight){
+                best = g;
+                bestWeight = total;
+            }
+        }
+        if (!bestWeight){
+            break;
+        }
+        LLVM_DEBUG(dbgs() << "Grouping loops [" << groups[best].first << ", " << groups[best+1].second << ") of the fusion graph, reusing "
+                          << bestWeight << " bytes per iteration \n");
+        groups[best].second = groups[best+1].second;
+        groups.erase(groups.begin() + best + 1);
+    }
+
+    for (auto &group : groups) {
+        if (group.second - group.first < 2){
+            continue;
+        }
+        ++NumFusionGroups;
+        Loop *L1 = set[group.first]->loop;
+        ORE.emit([&]() {
+            return OptimizationRemarkAnalysis(DEBUG_TYPE, "FusionGroup", L1->getStartLoc(), L1->getHeader())
+                   << "fusion graph grouped " << ore::NV("Loops", group.second - group.first) << " loops";
+        });
+    }
+    return groups;
+}
+
+//greedily fuse each candidate of the set with the ones that follow it: each pair is checked once by canFuseLoops,
+//then the longest run of candidates that fuse as they are is merged in a single rewrite, otherwise the pair is
+//peeled, shifted or versioned and fused by fuseLoopPair.
+//a rejected pair is remembered and only checked again once one of its loops has been fused
+bool sweepCandidateSet(fusionCandidateSet &set, DenseSet<std::pair<fusionCandidate*, fusionCandidate*>> &rejected, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, LoopInfo &LI, Function &F, FunctionAnalysisManager &AM, fusionBudget &Budget) {
+    bool changed = false;
+    bool fused = true;
+    while (fused) {
+        fused = false;
+        size_t i = 0;
+        while (i + 1 < set.size()) {
+            std::pair<fusionCandidate*, fusionCandidate*> pair(set[i], set[i+1]);
+            if (rejected.count(pair)){
+                ++i;
+                continue;
+            }
+            if (isOverBudget(Budget, set[i]->loop, ORE)){
+                return changed;
+            }
+
+            fusionPlan plan;
+            if (!canFuseLoops(set[i], set[i+1], SE, DT, PDT, DI, AA, AddRecs, ORE, F, AM, plan)){
+                rejected.insert(pair);
+                ++i;
+                continue;
+            }
+
+            //a pair that fuses as it is starts a run, that the following candidates join while they fuse as they are
+            if (!plan.peelCount && !plan.shift && !plan.versioned) {
+                SmallVector<fusionCandidate*, 4> run = {set[i], set[i+1]};
+                SmallVector<accessBuckets, 4> runBuckets;
+                accessBuckets allBuckets;
+                collectAccessBuckets(set[i]->loop, allBuckets);
+                collectAccessBuckets(set[i+1]->loop, allBuckets);
+                runBuckets.push_back(std::move(plan.L1Buckets));
+                runBuckets.push_back(std::move(plan.L2Buckets));
+                reportMovedCode(set[i]->loop, plan.movedInstructions.size(), ORE);
+                while (i + run.size() < set.size() && !rejected.count({run.back(), set[i + run.size()]}) &&
+                       canExtendRun(run, set[i + run.size()], runBuckets, allBuckets, SE, DT, PDT, DI, AA, AddRecs, ORE, F, AM)) {
+                    run.push_back(set[i + run.size()]);
+                }
+
+                //the merged loops are erased by fuseLoops, take their locations first
+                SmallVector<Loop*, 4> loops;
+                SmallVector<DebugLoc, 4> locations;
+                for (fusionCandidate *C : run) {
+                    loops.push_back(C->loop);
+                    locations.push_back(C->loop->getStartLoc());
+                }
+                fuseLoops(loops, DT, PDT, LI, F, DI, SE, AddRecs, AM);
+
+                Loop *L1 = loops.front();
+                LLVM_DEBUG(dbgs() << "Fused a run of " << run.size() << " loops. \n");
+                for (DebugLoc &location : drop_begin(locations)) {
+                    ++NumFusedLoops;
+                    ORE.emit([&]() {
+                        return OptimizationRemark(DEBUG_TYPE, "Fused", L1->getStartLoc(), L1->getHeader())
+                               << "loop fused with the loop at " << ore::NV("SecondLoop", location);
+                    });
+                }
+                cleanUpFusedLoop(L1, SE, AA, AddRecs, DT, AM.getResult<AssumptionAnalysis>(F), ORE);
+                NumParallelLoops += markParallelAccesses(L1, DI);
+
+                set.erase(set.begin() + i + 1, set.begin() + i + run.size());
+                if (i > 0){
+                    rejected.erase({set[i-1], set[i]});
+                }
+                fused = changed = true;
+                continue;
+            }
+
+            if (!fuseLoopPair(set[i], set[i+1], plan, SE, DT, PDT, DI, AA, AddRecs, ORE, LI, F, AM)){
+                rejected.insert(pair);
+                ++i;
+                continue;
+            }
+            //L2 has already been erased from LoopInfo by fuseLoops, drop its candidate and
+            //keep fusing into set[i]; the pair ending in set[i] is checked again in the next sweep
+            set.erase(set.begin() + i + 1);
+            if (i > 0){
+                rejected.erase({set[i-1], set[i]});
+            }
+            fused = changed = true;
+        }
+    }
+    return changed;
+}
+
+//fuse the loops of each group chosen by partitionCandidateSet on their own, so that a pair of loops that share
+//little data cannot take a loop away from a better group. Loops of different groups are never fused together,
+//as that would undo the partition; sets too small or too large for the fusion graph are swept in program order
+bool fuseCandidateSet(fusionCandidateSet &set, DenseSet<std::pair<fusionCandidate*, fusionCandidate*>> &rejected, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, LoopInfo &LI, Function &F, FunctionAnalysisManager &AM, fusionBudget &Budget) {
+    if (set.size() <= 2 || set.size() > MaxFusionGraphSize) {
+        return sweepCandidateSet(set, rejected, SE, DT, PDT, DI, AA, AddRecs, ORE, LI, F, AM, Budget);
+    }
+
+    bool changed = false;
+    fusionCandidateSet partitioned;
+    for (auto &group : partitionCandidateSet(set, SE, DT, DI, AA, AddRecs, ORE, F.getParent()->getDataLayout(), Budget)) {
+        fusionCandidateSet subset(set.begin() + group.first, set.begin() + group.second);
+        changed |= sweepCandidateSet(subset, rejected, SE, DT, PDT, DI, AA, AddRecs, ORE, LI, F, AM, Budget);
+        partitioned.append(subset.begin(), subset.end());
+    }
+    set = partitioned;
+    return changed;
+}
+
+//the conditional branch that enters L or skips it, in the block of L's parent loop right before its preheader
+BranchInst *getGuardBranch(Loop *L, LoopInfo &LI) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *guardBB = preheader ? preheader->getUniquePredecessor() : nullptr;
+    if (!guardBB || LI.getLoopFor(guardBB) != L->getParentLoop()){
+        return nullptr;
+    }
+    BranchInst *guard = dyn_cast<BranchInst>(guardBB->getTerminator());
+    if (!guard || !guard->isConditional() || guard->getSuccessor(0) == guard->getSuccessor(1)){
+        return nullptr;
+    }
+    return guard;
+}
+
+//the comparison that holds when Branch goes to Target, on SCEVs so that the guards of two loops
+//compare equal even if each one computes its own condition
+std::optional<guardCondition> getBranchCondition(BranchInst *Branch, BasicBlock *Target, ScalarEvolution &SE) {
+    ICmpInst *compare = dyn_cast<ICmpInst>(Branch->getCondition());
+    if (!compare || !SE.isSCEVable(compare->getOperand(0)->getType())){
+        return std::nullopt;
+    }
+    ICmpInst::Predicate pred = compare->getPredicate();
+    if (Branch->getSuccessor(0) != Target){
+        pred = ICmpInst::getInversePredicate(pred);
+    }
+    return guardCondition{pred, SE.getSCEV(compare->getOperand(0)), SE.getSCEV(compare->getOperand(1))};
+}
+
+bool isSameCondition(const guardCondition &A, const guardCondition &B) {
+    return (A.pred == B.pred && A.LHS == B.LHS && A.RHS == B.RHS) ||
+           (A.pred == ICmpInst::getSwappedPredicate(B.pred) && A.LHS == B.RHS && A.RHS == B.LHS);
+}
+
+//check that Cond is false whenever From branches to To: either From tests the opposite condition,
+//or a branch that dominates it does
+bool isFalseOnEdge(BasicBlock *From, BasicBlock *To, const guardCondition &Cond, ScalarEvolution &SE) {
+    guardCondition inverse = {ICmpInst::getInversePredicate(Cond.pred), Cond.LHS, Cond.RHS};
+    BranchInst *branch = dyn_cast<BranchInst>(From->getTerminator());
+    if (branch && branch->isConditional() && branch->getSuccessor(0) != branch->getSuccessor(1)){
+        std::optional<guardCondition> taken = getBranchCondition(branch, To, SE);
+        if (taken && isSameCondition(*taken, inverse)){
+            return true;
+        }
+    }
+    return SE.isKnownPredicateAt(inverse.pred, inverse.LHS, inverse.RHS, From->getTerminator());
+}
+
+//the guard compares values that are already computed at Point, so it can be evaluated there
+bool isGuardAvailableAt(BranchInst *Guard, Instruction *Point, DominatorTree &DT) {
+    return all_of(cast<ICmpInst>(Guard->getCondition())->operands(), [&](Value *V) {
+        Instruction *I = dyn_cast<Instruction>(V);
+        return !I || DT.dominates(I, Point);
+    });
+}
+
+//the paths through L1 will not go through the guard block anymore: it must only compute what its own branch and phis need
+bool canBypassGuardBlock(BasicBlock *GuardBB) {
+    for (Instruction &I : *GuardBB) {
+        if (isa<PHINode>(I) || I.isTerminator()){
+            continue;
+        }
+        if (I.mayHaveSideEffects() || any_of(I.users(), [&](User *U) { return cast<Instruction>(U)->getParent() != GuardBB; })){
+            return false;
+        }
+    }
+    return true;
+}
 
-    outs() << "Trip count of L2: ";
-    C2->tripCount->print(outs());
-    outs() << "\n";
+//none of the values of Blocks is used outside of them, so a copy of the blocks can share their successors
+bool isUsedOnlyInside(ArrayRef<BasicBlock*> Blocks) {
+    SmallPtrSet<BasicBlock*, 8> inside(Blocks.begin(), Blocks.end());
+    for (BasicBlock *BB : Blocks) {
+        for (Instruction &I : *BB) {
+            for (User *U : I.users()) {
+                if (!inside.count(cast<Instruction>(U)->getParent())){
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
 
-    // Check if both trip counts are equal
-    if (C1->tripCount != C2->tripCount) {
-        outs() << "Loops have a different trip count \n";
+//the exit counts of L1 and L2 are the same once the guards of Guarded also hold for the other loop
+bool haveSameTripCountUnderGuards(Loop *L1, Loop *L2, Loop *Guarded, ScalarEvolution &SE) {
+    if (!L1->getExitingBlock() || !L2->getExitingBlock()){
+        return false;
+    }
+    const SCEV *count1 = SE.getExitCount(L1, L1->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    const SCEV *count2 = SE.getExitCount(L2, L2->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    if (isa<SCEVCouldNotCompute>(count1) || isa<SCEVCouldNotCompute>(count2)){
         return false;
     }
+    return SE.applyLoopGuards(count1, Guarded) == SE.applyLoopGuards(count2, Guarded);
+}
 
-    outs() << "Loops have the same trip count \n";
+//L1 exits into the preheader of L2, that is folded into the exit: the loops are then adjacent as fuseLoops expects
+void joinExitToPreheader(Loop *L1, Loop *L2, DomTreeUpdater &DTU, LoopInfo &LI) {
+    BasicBlock *exit = L1->getExitBlock();
+    BasicBlock *preheader = L2->getLoopPreheader();
+    if (preheader != exit && preheader->getSinglePredecessor() == exit && exit->getSingleSuccessor() == preheader){
+        MergeBlockIntoPredecessor(preheader, &DTU, &LI);
+    }
+    FoldSingleEntryPHINodes(exit);
+}
 
-    if (!controlFlowEquivalent(L1->getOutermostLoop(), L2->getOutermostLoop(), DT, PDT)) {
-        outs() << "Loops are not control flow equivalent \n";
+//make L2, whose guard is reached when L1 exits, run whenever L1 does: the guard must hold on entry to L1 and fail on
+//every other path to it, as when both loops are guarded by the same condition. L1 then exits into L2's preheader
+//and the guard is only left on the paths that skip L1, es: %cmp3 in
+//  entry: br i1 %cmp1, label %for.body.lr.ph, label %for.end     for.end: %cmp3 = icmp slt i32 0, %n
+//  for.cond.for.end_crit_edge: br label %for.end                          br i1 %cmp3, label %for.body4.lr.ph, label %for.end15
+bool mergeGuards(Loop *L1, Loop *L2, BranchInst *Guard, const guardCondition &Cond, DominatorTree &DT, LoopInfo &LI, ScalarEvolution &SE, addRecCache &AddRecs, Function &F) {
+    BasicBlock *guardBB = Guard->getParent();
+    BasicBlock *preheader = L2->getLoopPreheader();
+    BasicBlock *skip = Guard->getSuccessor(Guard->getSuccessor(0) == preheader ? 1 : 0);
+    BasicBlock *exit = L1->getExitBlock();
+    BasicBlock *predecessor = L1->getLoopPredecessor();
+    if (!exit || !predecessor || !L1->hasDedicatedExits() || !preheader->phis().empty() ||
+        (exit != guardBB && exit->getSingleSuccessor() != guardBB) ||
+        !isGuardAvailableAt(Guard, predecessor->getTerminator(), DT) ||
+        !SE.isLoopEntryGuardedByCond(L1, Cond.pred, Cond.LHS, Cond.RHS)){
         return false;
     }
-    outs() << "Loops are control flow equivalent \n";
+    if (exit != guardBB){
+        if (!canBypassGuardBlock(guardBB)){
+            return false;
+        }
+        for (BasicBlock *pred : predecessors(guardBB)) {
+            if (pred != exit && !isFalseOnEdge(pred, guardBB, Cond, SE)){
+                return false;
+            }
+        }
+    }
+
+    DomTreeUpdater DTU(&DT, nullptr, DomTreeUpdater::UpdateStrategy::Lazy);
+    Instruction *compare = cast<Instruction>(Guard->getCondition());
+    if (exit != guardBB && guardBB->getSinglePredecessor() == exit){
+        MergeBlockIntoPredecessor(guardBB, &DTU, &LI);
+        guardBB = exit;
+    }
+
+    if (exit == guardBB){
+        //only L1 reaches the guard, that always enters L2
+        skip->removePredecessor(guardBB);
+        updateTerminator(guardBB, DTU, [&]() {
+            ReplaceInstWithInst(Guard, BranchInst::Create(preheader));
+        });
+    }else{
+        //L1 goes straight to L2, the other paths straight to the skip block
+        SmallVector<std::pair<PHINode*, Value*>, 4> exitValues;
+        for (PHINode &phi : guardBB->phis()) {
+            exitValues.push_back({&phi, phi.getIncomingValueForBlock(exit)});
+        }
+        updateTerminator(exit, DTU, [&]() {
+            exit->getTerminator()->replaceUsesOfWith(guardBB, preheader);
+        });
+        guardBB->removePredecessor(exit, true);
+        updateTerminator(guardBB, DTU, [&]() {
+            ReplaceInstWithInst(Guard, BranchInst::Create(skip));
+        });
+
+        //the phis of the guard block keep the values of the skipping paths, the value from L1 now flows
+        //through L2 and is merged with them again where the paths meet
+        for (auto &exitValue : exitValues) {
+            PHINode *phi = exitValue.first;
+            SmallVector<Use*, 8> uses;
+            for (Use &U : phi->uses()) {
+                if (cast<Instruction>(U.getUser())->getParent() != guardBB){
+                    uses.push_back(&U);
+                }
+            }
+            SSAUpdater SSA;
+            SSA.Initialize(phi->getType(), phi->getName());
+            SSA.AddAvailableValue(exit, exitValue.second);
+            SSA.AddAvailableValue(guardBB, phi);
+            for (Use *U : uses) {
+                SSA.RewriteUse(*U);
+            }
+        }
+    }
+    RecursivelyDeleteTriviallyDeadInstructions(compare);
+    joinExitToPreheader(L1, L2, DTU, LI);
+
+    DTU.flush();
+    forgetLoop(L1, SE, AddRecs);
+    forgetLoop(L2, SE, AddRecs);
+    if (VerifyDomTrees){
+        verifyDomTree(F, DT);
+    }
+    return true;
+}
 
-    if (!dependencesAllowFusion(L1,L2,DT,SE, DI)) {
-        outs() << "Loops are dependent \n";
+//when the guard of L2 is not known to hold on entry to L1, test it before L1 and take a copy of L1 where it fails:
+//that copy goes on to the guard, that now always skips L2 from it, while mergeGuards joins L1 to L2. The copy
+//costs code, so it is only made for innermost loops that run the same number of iterations under the guard
+bool versionGuard(Loop *L1, Loop *L2, BranchInst *Guard, const guardCondition &Cond, DominatorTree &DT, LoopInfo &LI, ScalarEvolution &SE, addRecCache &AddRecs, Function &F) {
+    BasicBlock *guardBB = Guard->getParent();
+    BasicBlock *preheader = L1->getLoopPreheader();
+    BasicBlock *exit = L1->getExitBlock();
+    BasicBlock *exiting = L1->getExitingBlock();
+    if (!VersionGuards || !L1->isInnermost() || !preheader || !exit || !exiting || !L2->getLoopPreheader()->phis().empty() ||
+        (exit != guardBB && (exit->size() != 1 || exit->getSingleSuccessor() != guardBB)) ||
+        !isGuardAvailableAt(Guard, preheader->getTerminator(), DT) || !canBypassGuardBlock(guardBB) ||
+        !isUsedOnlyInside(L1->getBlocks()) || !haveSameTripCountUnderGuards(L1, L2, L2, SE)){
         return false;
     }
+    for (BasicBlock *pred : predecessors(guardBB)) {
+        if (pred != exit && !L1->contains(pred) && !isFalseOnEdge(pred, guardBB, Cond, SE)){
+            return false;
+        }
+    }
+
+    DomTreeUpdater DTU(&DT, nullptr, DomTreeUpdater::UpdateStrategy::Lazy);
+    ICmpInst *compare = cast<ICmpInst>(Guard->getCondition());
+    Value *condition = compare;
+    if (!DT.dominates(compare, preheader->getTerminator())){
+        Instruction *hoisted = compare->clone();
+        hoisted->insertBefore(preheader->getTerminator());
+        hoisted->setName(compare->getName() + ".hoisted");
+        condition = hoisted;
+    }
+
+    ValueToValueMapTy VMap;
+    cloneForFallback(L1, nullptr, VMap, DTU, LI, F);
+    BasicBlock *header = L1->getHeader();
+    BasicBlock *copyHeader = cast<BasicBlock>(VMap[header]);
+    BasicBlock *copyExiting = cast<BasicBlock>(VMap[exiting]);
+    bool entersOnTrue = Guard->getSuccessor(0) == L2->getLoopPreheader();
+    BranchInst *branch = BranchInst::Create(entersOnTrue ? header : copyHeader, entersOnTrue ? copyHeader : header, condition);
+    updateTerminator(preheader, DTU, [&]() {
+        ReplaceInstWithInst(preheader->getTerminator(), branch);
+    });
+
+    //the copy leaves through the guard block, L1 keeps an exit of its own
+    if (exit != guardBB){
+        updateTerminator(copyExiting, DTU, [&]() {
+            copyExiting->getTerminator()->replaceUsesOfWith(exit, guardBB);
+        });
+        for (PHINode &phi : guardBB->phis()) {
+            phi.addIncoming(phi.getIncomingValueForBlock(exit), copyExiting);
+        }
+    }else{
+        SplitBlockPredecessors(guardBB, {exiting}, ".loopexit", &DTU, &LI);
+    }
+
+    //both loops get a preheader again
+    SplitBlockPredecessors(header, {preheader}, ".preheader", &DTU, &LI);
+    SplitBlockPredecessors(copyHeader, {preheader}, ".preheader", &DTU, &LI);
+    DTU.flush();
+    forgetLoop(L1, SE, AddRecs);
+    if (VerifyDomTrees){
+        verifyDomTree(F, DT);
+    }
+    return true;
+}
+
+//the condition of the nearest branch, in L's parent loop, that has to be taken to enter L
+std::optional<guardCondition> getEntryCondition(Loop *L, DominatorTree &DT, LoopInfo &LI, ScalarEvolution &SE) {
+    BasicBlock *header = L->getHeader();
+    for (DomTreeNode *node = DT.getNode(header)->getIDom(); node; node = node->getIDom()) {
+        BasicBlock *BB = node->getBlock();
+        BranchInst *branch = dyn_cast<BranchInst>(BB->getTerminator());
+        if (LI.getLoopFor(BB) != L->getParentLoop() || !branch || !branch->isConditional() ||
+            branch->getSuccessor(0) == branch->getSuccessor(1)){
+            continue;
+        }
+        for (BasicBlock *Succ : branch->successors()) {
+            if (DT.dominates(BasicBlockEdge(BB, Succ), header)){
+                return getBranchCondition(branch, Succ, SE);
+            }
+        }
+    }
+    return std::nullopt;
+}
 
-    outs() << "Loops don't have any negative distance dependences \n";
-    outs() << "All Loop Fusion conditions satisfied. \n";
+//when L2 runs both after L1 and on paths where the condition Cond that enters L1 is false, give those paths a copy
+//of L2 and of its preheader: L2 itself then only runs after L1. As in versionGuard, the trip counts must be the same
+//under the guard
+bool versionSkippedLoop(Loop *L1, Loop *L2, const guardCondition &Cond, DominatorTree &DT, LoopInfo &LI, ScalarEvolution &SE, addRecCache &AddRecs, Function &F) {
+    BasicBlock *preheader = L2->getLoopPreheader();
+    BasicBlock *exit = L1->getExitBlock();
+    if (!VersionGuards || !L2->isInnermost() || !exit || !L2->getExitBlock() || exit == preheader ||
+        exit->getSingleSuccessor() != preheader || !haveSameTripCountUnderGuards(L1, L2, L1, SE)){
+        return false;
+    }
+    SmallVector<BasicBlock*, 4> skipping;
+    for (BasicBlock *pred : predecessors(preheader)) {
+        if (pred != exit){
+            if (!isFalseOnEdge(pred, preheader, Cond, SE)){
+                return false;
+            }
+            skipping.push_back(pred);
+        }
+    }
+    SmallVector<BasicBlock*, 8> blocks = {preheader};
+    blocks.append(L2->block_begin(), L2->block_end());
+    if (skipping.empty() || !isUsedOnlyInside(blocks)){
+        return false;
+    }
 
-    fuseLoops(L1, L2, DT, PDT, LI, F, DI, SE, AM);
+    DomTreeUpdater DTU(&DT, nullptr, DomTreeUpdater::UpdateStrategy::Lazy);
+    ValueToValueMapTy VMap;
+    cloneForFallback(L2, preheader, VMap, DTU, LI, F);
+    BasicBlock *copyPreheader = cast<BasicBlock>(VMap[preheader]);
+    for (BasicBlock *pred : skipping) {
+        updateTerminator(pred, DTU, [&]() {
+            pred->getTerminator()->replaceUsesOfWith(preheader, copyPreheader);
+        });
+        for (PHINode &phi : preheader->phis()) {
+            phi.removeIncomingValue(pred, false);
+        }
+    }
+    for (PHINode &phi : copyPreheader->phis()) {
+        phi.removeIncomingValue(exit, false);
+    }
+    joinExitToPreheader(L1, L2, DTU, LI);
+
+    //the copy rejoins L2 at its exit, that is split so that L2 still has a dedicated one for the next loop
+    BasicBlock *exit2 = L2->getExitBlock();
+    SmallVector<BasicBlock*, 4> exiting2;
+    for (BasicBlock *pred : predecessors(exit2)) {
+        if (L2->contains(pred)){
+            exiting2.push_back(pred);
+        }
+    }
+    SplitBlockPredecessors(exit2, exiting2, ".loopexit", &DTU, &LI);
 
-    outs() << "The code has been transformed. \n";
+    DTU.flush();
+    forgetLoop(L2, SE, AddRecs);
+    if (VerifyDomTrees){
+        verifyDomTree(F, DT);
+    }
     return true;
 }
 
+//L2 runs whenever L1 has run, and only then: the exit of L1 leads to the preheader of L2 through blocks that
+//have no other way in or out. It stands for control flow equivalence while the post-dominator tree is out of date
+bool runsRightAfter(Loop *L1, Loop *L2) {
+    BasicBlock *BB = L1->hasDedicatedExits() ? L1->getExitBlock() : nullptr;
+    BasicBlock *preheader = L2->getLoopPreheader();
+    SmallPtrSet<BasicBlock*, 4> visited;
+    while (BB && BB != preheader && visited.insert(BB).second) {
+        BasicBlock *next = BB->getSingleSuccessor();
+        BB = next && next->getSinglePredecessor() == BB ? next : nullptr;
+    }
+    return BB && BB == preheader;
+}
+
+//how many times the body of L runs, under the guards of Guarded: a loop that exits from its header
+//takes as many backedges, one that exits from its latch one less. The fused loop is only entered when the
+//bodies run, under the guard that rotation or versionGuard gives it, so a count like (1 smax X) is X
+const SCEV *getBodyCount(Loop *L, Loop *Guarded, ScalarEvolution &SE) {
+    const SCEV *count = SE.getExitCount(L, L->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    if (isa<SCEVCouldNotCompute>(count)){
+        return count;
+    }
+    if (!isHeaderExiting(L)){
+        count = SE.getAddExpr(count, SE.getOne(count->getType()));
+    }
+    count = SE.applyLoopGuards(count, Guarded);
+    if (isa<SCEVSMaxExpr>(count) || isa<SCEVUMaxExpr>(count)){
+        const SCEVNAryExpr *max = cast<SCEVNAryExpr>(count);
+        const SCEVConstant *bound = dyn_cast<SCEVConstant>(max->getOperand(0));
+        if (max->getNumOperands() == 2 && bound && bound->getAPInt().sle(1)){
+            count = max->getOperand(1);
+        }
+    }
+    return count;
+}
+
+//check, before L1 and L2 are brought to the same shape, that they could then be fused: their bodies run as many
+//times, up to a few iterations that can be peeled, under the guards of either loop, and their nests, dependences
+//and profitability allow it. The other pairs are left as they are, as rotating, guarding or copying them would
+//only cost code and compile time
+bool mayFuseOnceNormalized(Loop *L1, Loop *L2, DominatorTree &DT, ScalarEvolution &SE, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, Function &F, FunctionAnalysisManager &AM) {
+    if (!L1->getExitingBlock() || !L2->getExitingBlock()){
+        return false;
+    }
+    bool tripCountsMatch = false;
+    for (Loop *Guarded : {L1, L2}) {
+        const SCEV *count1 = getBodyCount(L1, Guarded, SE);
+        const SCEV *count2 = getBodyCount(L2, Guarded, SE);
+        if (isa<SCEVCouldNotCompute>(count1) || isa<SCEVCouldNotCompute>(count2) || count1->getType() != count2->getType()){
+            return false;
+        }
+        std::optional<int64_t> difference = getConstantDifference(count1, count2, SE);
+        tripCountsMatch |= difference && std::abs(*difference) <= MaxPeelCount;
+    }
+    if (!tripCountsMatch || !nestsAllowFusion(L1, L2, SE)){
+        return false;
+    }
+
+    accessBuckets L1Buckets;
+    accessBuckets L2Buckets;
+    collectAccessBuckets(L1, L1Buckets);
+    collectAccessBuckets(L2, L2Buckets);
+    SmallVector<std::pair<const Value*, const Value*>, 4> checks;
+    int64_t shift = 0;
+    if (countDependenceQueries(L1Buckets, L2Buckets, AA) > MaxDependenceQueries ||
+        !dependencesAllowFusion(L1, L2, L1Buckets, L2Buckets, DT, SE, DI, AA, AddRecs, checks, shift)){
+        return false;
+    }
+
+    TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    fusionProfitability profitability = estimateProfitability(L1, L2, L1Buckets, L2Buckets, TTI, SE, AddRecs, F.getParent()->getDataLayout());
+    return profitability.savings - profitability.registerCost - profitability.vectorizationCost > FusionProfitThreshold;
+}
+
+void reportNormalization(Loop *L, StringRef RemarkName, StringRef Message, OptimizationRemarkEmitter &ORE) {
+    ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, RemarkName, L->getStartLoc(), L->getHeader()) << Message;
+    });
+}
+
+//bring L1 and the next loop L2 to the shape fuseLoops handles, so that loops rotated by the pipeline fuse as the
+//ones of -O0 code do: a for loop next to a do-while (or rotated) one is rotated too, the guard of L2 is merged into
+//the one of L1 or moved above L1, L2 is copied for the paths that skip L1, and loops of a single block
+//get a latch of their own. Only the pairs that mayFuseOnceNormalized are changed; each step keeps the code equivalent,
+//so it is kept even if the loops are not fused in the end. L1 is not copied when it already runs right after the loop
+//before it, Previous, as the copy would take it away. Only the dominator tree is kept up to date, the caller
+//recomputes the post-dominator tree once the pairs of a level are normalized
+bool normalizeLoopPair(Loop *Previous, Loop *L1, Loop *L2, DominatorTree &DT, LoopInfo &LI, ScalarEvolution &SE, DependenceInfo &DI, AAResults &AA, addRecCache &AddRecs, OptimizationRemarkEmitter &ORE, Function &F, FunctionAnalysisManager &AM) {
+    if (L1->getParentLoop() != L2->getParentLoop() || !L1->isLoopSimplifyForm() || !L2->isLoopSimplifyForm() ||
+        !mayFuseOnceNormalized(L1, L2, DT, SE, DI, AA, AddRecs, F, AM)){
+        return false;
+    }
+
+    bool changed = false;
+    BasicBlock *exit = L1->getExitBlock();
+    bool follows = exit && (exit == L2->getLoopPreheader() || exit->getSingleSuccessor() == L2->getLoopPreheader());
+    if (isHeaderExiting(L1) != isHeaderExiting(L2) && follows){
+        Loop *L = isHeaderExiting(L1) ? L1 : L2;
+        SimplifyQuery SQ(F.getParent()->getDataLayout(), nullptr, &DT, &AM.getResult<AssumptionAnalysis>(F));
+        if (!LoopRotation(L, &LI, &AM.getResult<TargetIRAnalysis>(F), &AM.getResult<AssumptionAnalysis>(F), &DT, &SE,
+                          nullptr, SQ, true, MaxRotationHeaderSize, false)){
+            return false;
+        }
+        forgetLoop(L, SE, AddRecs);
+        ++NumRotatedLoops;
+        reportNormalization(L, "Rotated", "loop rotated to the shape of the loop it is fused with", ORE);
+        changed = true;
+    }
+
+    if (BranchInst *guard = getGuardBranch(L2, LI)){
+        std::optional<guardCondition> cond = getBranchCondition(guard, L2->getLoopPreheader(), SE);
+        if (cond && mergeGuards(L1, L2, guard, *cond, DT, LI, SE, AddRecs, F)){
+            ++NumMergedGuards;
+            reportNormalization(L2, "MergedGuard", "guard of the loop merged into the guard of the loop before it", ORE);
+            changed = true;
+        }else if (cond && !(Previous && runsRightAfter(Previous, L1)) && versionGuard(L1, L2, guard, *cond, DT, LI, SE, AddRecs, F)){
+            ++NumVersionedGuards;
+            reportNormalization(L1, "VersionedGuard", "loop copied to test the guard of the next loop before it", ORE);
+            changed = true;
+            if (mergeGuards(L1, L2, guard, *cond, DT, LI, SE, AddRecs, F)){
+                ++NumMergedGuards;
+            }
+        }
+    }else if (std::optional<guardCondition> cond = getEntryCondition(L1, DT, LI, SE)){
+        if (versionSkippedLoop(L1, L2, *cond, DT, LI, SE, AddRecs, F)){
+            ++NumVersionedGuards;
+            reportNormalization(L2, "VersionedGuard", "loop copied for the paths that skip the loop before it", ORE);
+            changed = true;
+        }
+    }
+
+    if (L1->getExitBlock() == L2->getLoopPreheader()){
+        DomTreeUpdater DTU(&DT, nullptr, DomTreeUpdater::UpdateStrategy::Lazy);
+        for (Loop *L : {L1, L2}) {
+            BasicBlock *header = L->getHeader();
+            if (L->getLoopLatch() == header){
+                SplitBlock(header, header->getTerminator(), &DTU, &LI, nullptr, header->getName() + ".latch");
+                forgetLoop(L, SE, AddRecs);
+                changed = true;
+            }
+        }
+        DTU.flush();
+    }
+    return changed;
+}
+
 bool runOnFunction(Function &F, FunctionAnalysisManager &AM) {
-    outs() << "Start \n";
+    LLVM_DEBUG(dbgs() << "Start \n");
     ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
     DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
     PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
     DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
     LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
-    
-    // Build up a worklist of inner-loops to version.
-    SmallVector<Loop *, 8> Worklist;
-    for (Loop *TopLevelLoop : LI)
-        for (Loop *L : depth_first(TopLevelLoop))
-            if (L->isInnermost())
-                Worklist.push_back(L);
-    
-    // Convert the worklist of loops to fusion candidates.
-    std::vector<fusionCandidate*> loops;
-    for (Loop *L : Worklist) {
-        fusionCandidate* f = new fusionCandidate;
-        f->tripCount = nullptr;
-        f->loop = L;
-        loops.push_back(f);
+    AAResults &AA = AM.getResult<AAManager>(F);
+    OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+    BlockFrequencyInfo &BFI = AM.getResult<BlockFrequencyAnalysis>(F);
+    //a function pass can only read the profile summary if it has already been computed for the module
+    ProfileSummaryInfo *PSI = AM.getResult<ModuleAnalysisManagerFunctionProxy>(F).getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+
+    //the candidates only live as long as this function is being processed
+    SpecificBumpPtrAllocator<fusionCandidate> candidateAllocator;
+
+    //walk the loop nests from the outermost level inward: the loops of a level are fused first,
+    //then the subloops of the surviving loops, that are siblings if their parents have been fused
+    SmallVector<Loop*, 8> level;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (L->isOutermost()) {
+            level.push_back(L);
+        }
     }
 
-    outs() << "Found " << loops.size() << " loops! \n";
-
-    if(loops.size() == 0){
-        return false;
-    }
-    while (true) {
-        bool fused = false;
-        fusionCandidate* secondLoop = nullptr;
-        for (size_t i = loops.size() - 1; i > 0; --i) {
-            if (tryFuseLoops(loops[i], loops[i-1], SE, DT, PDT, DI, LI, F, AM)) {
-                fused = true;
-                secondLoop = loops[i-1];
+    DenseSet<std::pair<fusionCandidate*, fusionCandidate*>> rejected;
+    addRecCache AddRecs;
+    fusionBudget Budget = {0, std::chrono::steady_clock::now() + std::chrono::milliseconds(TimeBudget), false};
+    bool truncated = false;
+    bool changed = false;
+    while (!level.empty() && !truncated && !Budget.timedOut) {
+        // Convert the loops of this level, in program order, to fusion candidates.
+        SmallVector<fusionCandidate*, 8> loops;
+        for (Loop *L : level) {
+            //fusing a cold loop costs compile time, code size and registers for nothing
+            if (!FuseColdLoops && PSI && PSI->hasProfileSummary() && PSI->isColdBlock(L->getHeader(), &BFI)){
+                ++NumColdLoops;
+                ORE.emit([&]() {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "Cold", L->getStartLoc(), L->getHeader())
+                           << "loop not fused: " << ore::NV("Reason", "cold");
+                });
+                continue;
+            }
+            //the size of a loop bounds the dependence queries and the code copied by each fusion
+            unsigned size = 0;
+            for (BasicBlock *BB : L->blocks()) {
+                size += BB->size();
+            }
+            if (size > MaxLoopSize){
+                reportBudgetStop(L, "max-loop-size", ORE);
+                continue;
+            }
+            //the loops past the limit are left as they are, with their subloops
+            if (Budget.candidates == MaxCandidates){
+                reportBudgetStop(L, "max-candidates", ORE);
+                truncated = true;
                 break;
             }
+            ++Budget.candidates;
+            fusionCandidate *C = new (candidateAllocator.Allocate()) fusionCandidate{nullptr, L};
+            C->hotness = getHotness(L, BFI, SE);
+            loops.push_back(C);
         }
 
-        if (fused && secondLoop) {
-            // Remove the loop from LoopInfo
-            loops.erase(std::remove(loops.begin(), loops.end(), secondLoop), loops.end());
-        } else {
-            break;
+        LLVM_DEBUG(dbgs() << "Found " << loops.size() << " loops at depth " << level.front()->getLoopDepth() << "! \n");
+        NumCandidates += loops.size();
+
+        //the loops are compared with their neighbour in program order after being brought to the same shape
+        bool normalized = false;
+        for (unsigned i = 1; i < loops.size(); ++i) {
+            Loop *previous = i > 1 ? loops[i - 2]->loop : nullptr;
+            normalized |= normalizeLoopPair(previous, loops[i - 1]->loop, loops[i]->loop, DT, LI, SE, DI, AA, AddRecs, ORE, F, AM);
+        }
+        //normalization only keeps the dominator tree up to date
+        if (normalized){
+            PDT.recalculate(F);
+            changed = true;
+        }
+
+        //the hottest sets are fused first. The subloops of different sets are never fused together,
+        //so the next level does not need to keep the program order across sets
+        std::vector<fusionCandidateSet> sets = collectCandidateSets(loops, DT, PDT);
+        auto getSetHotness = [](const fusionCandidateSet &set) {
+            uint64_t hotness = 0;
+            for (fusionCandidate *C : set) {
+                hotness = std::max(hotness, C->hotness);
+            }
+            return hotness;
+        };
+        llvm::stable_sort(sets, [&](const fusionCandidateSet &A, const fusionCandidateSet &B) {
+            return getSetHotness(A) > getSetHotness(B);
+        });
+        level.clear();
+        for (fusionCandidateSet &set : sets) {
+            changed |= fuseCandidateSet(set, rejected, SE, DT, PDT, DI, AA, AddRecs, ORE, LI, F, AM, Budget);
+            for (fusionCandidate *C : set) {
+                level.append(C->loop->begin(), C->loop->end());
+            }
         }
     }
-    return false;
+    return changed;
 }
 
 PreservedAnalyses LoopFusionPass::run(Function &F, FunctionAnalysisManager &AM) {
-    runOnFunction(F, AM);
-    return PreservedAnalyses::none();
+    if (!runOnFunction(F, AM)){
+        return PreservedAnalyses::all();
+    }
+
+    //fuseLoops keeps these up to date after every fusion
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<PostDominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    PA.preserve<ScalarEvolutionAnalysis>();
+    return PA;
 }
@@ -1,34 +1,67 @@
 #ifndef LLVM_TRANSFORMS_LOOPFUSIONPASS_LOOPFUSIONPASS_H
 #define LLVM_TRANSFORMS_LOOPFUSIONPASS_LOOPFUSIONPASS_H
 
+#include "llvm/Analysis/AliasAnalysis.h" // No-alias checks between access buckets
 #include "llvm/Analysis/ScalarEvolution.h" // Loop Trip Count
+#include "llvm/Analysis/ValueTracking.h" // getUnderlyingObject
 #include "llvm/IR/Dominators.h" // Loop Trip Count
 #include "llvm/Analysis/PostDominators.h" // Control Flow Equivalence
+#include "llvm/Analysis/TargetTransformInfo.h" // Profitability
+#include "llvm/Analysis/VectorUtils.h" // Access groups of the fused loops
 #include "llvm/Analysis/DependenceAnalysis.h" // Dependence Analysis
+#include "llvm/Analysis/DomTreeUpdater.h" // Incremental DT/PDT updates
 #include "llvm/IR/PassManager.h" // For FunctionPass
 #include "llvm/Transforms/Utils/LoopUtils.h" // Loop analysis
 #include "llvm/Transforms/Utils/BasicBlockUtils.h" // for merging basic blocks
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h" // Runtime alias checks
+#include "llvm/IR/ValueMap.h" // Recurrences cached per access
 #include "llvm/Analysis/LoopInfo.h" // Loop and LoopInfo classes
 #include "llvm/Analysis/LoopNestAnalysis.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h" // Fusion remarks
+#include "llvm/Analysis/BlockFrequencyInfo.h" // Hotness of the candidates
+#include "llvm/Analysis/ProfileSummaryInfo.h" // Cold loops
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/Pass.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/ScopeExit.h" // Moved code goes back when a pair is rejected
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/Allocator.h" // Per-function candidate arena
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/Cloning.h" // Remainder loops
 #include "llvm/Transforms/Utils/CodeMoverUtils.h"
 #include "llvm/Transforms/Utils/LoopSimplify.h"
 #include "llvm/Transforms/Utils/LoopSimplify.h" // Include per LoopSimplify
+#include "llvm/Transforms/Utils/Local.h" // RecursivelyDeleteTriviallyDeadInstructions(Permissive)
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h" // Materialize trip count bounds
+#include "llvm/Transforms/Utils/LoopRotationUtils.h" // Loops of different shapes
+#include "llvm/Transforms/Utils/SSAUpdater.h" // Merged loop guards
+#include "llvm/Transforms/Utils/PromoteMemToReg.h" // Temporary arrays replaced with a scalar
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include <chrono>
+#include <optional>
 #include <vector>
 
 namespace llvm {
 
+class PassBuilder;
+
 class LoopFusionPass : public PassInfoMixin<LoopFusionPass> {
 public:
     PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
 };
 
+//adds loop-fuse to the default O2/O3 pipelines and to the full and thin LTO post-link pipelines
+//built by PB (LoopFusePipeline.cpp, registered by the plugin)
+void registerLoopFusionPassCallbacks(PassBuilder &PB);
+
 }
 
 #endif /* LLVM_TRANSFORMS_LOOPFUSIONPASS_LOOPFUSIONPASS_H */
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "llvm/Transforms/Utils/LoopFusePass.h"
+#include "llvm/Passes/PassBuilder.h" // Extension points of the default pipelines
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+
+using namespace llvm;
+
+//-mllvm -enable-loop-fuse=false with clang, -Wl,-mllvm,-enable-loop-fuse=false with LTO
+static cl::opt<bool> EnableLoopFuse(
+    "enable-loop-fuse", cl::init(true), cl::Hidden,
+    cl::desc("Run loop-fuse in the default O2/O3 pipelines and in the LTO post-link pipelines"));
+
+//-Wl,-mllvm,-loop-fuse-lto-cleanup with LTO
+static cl::opt<bool> LTOCleanup(
+    "loop-fuse-lto-cleanup", cl::init(false), cl::Hidden,
+    cl::desc("In the full LTO post-link pipeline, vectorize and simplify again the functions where loop-fuse fused loops"));
+
+//fusion grows the code with peeled iterations and versioned loops, so it is left out at Os/Oz
+static bool shouldRunLoopFuse(OptimizationLevel Level) {
+    return EnableLoopFuse && Level.getSpeedupLevel() > 1 && Level.getSizeLevel() == 0;
+}
+
+namespace {
+
+//loop-fuse followed by Cleanup, that only runs on the functions loop-fuse changed
+struct LoopFusionCleanupPass : PassInfoMixin<LoopFusionCleanupPass> {
+    FunctionPassManager Cleanup;
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        PreservedAnalyses PA = LoopFusionPass().run(F, AM);
+        if (PA.areAllPreserved()) {
+            return PA;
+        }
+        AM.invalidate(F, PA);
+        PA.intersect(Cleanup.run(F, AM));
+        return PA;
+    }
+};
+
+}
+
+void llvm::registerLoopFusionPassCallbacks(PassBuilder &PB) {
+    //per-module pipeline and ThinLTO post-link: loops have been rotated and hoisted by LICM in the
+    //function simplification pipeline, and the vectorizer runs right after this point. SimplifyCFG
+    //may have folded their preheaders and exits since then
+    PB.registerVectorizerStartEPCallback([](FunctionPassManager &FPM, OptimizationLevel Level) {
+        if (shouldRunLoopFuse(Level)) {
+            FPM.addPass(LoopSimplifyPass());
+            FPM.addPass(LoopFusionPass());
+        }
+    });
+
+    //the full LTO post-link pipeline has no extension point before its vectorizer: fuse at its end.
+    //With -loop-fuse-lto-cleanup the fused loops are vectorized again, followed by instcombine and
+    //simplifycfg, at the cost of a second run of those passes on each function where loops were fused;
+    //the loops that were already vectorized are marked llvm.loop.isvectorized and the vectorizer skips them
+    PB.registerFullLinkTimeOptimizationLastEPCallback([](ModulePassManager &MPM, OptimizationLevel Level) {
+        if (!shouldRunLoopFuse(Level)) {
+            return;
+        }
+        FunctionPassManager FPM;
+        FPM.addPass(LoopSimplifyPass());
+        if (LTOCleanup) {
+            LoopFusionCleanupPass Fusion;
+            Fusion.Cleanup.addPass(LoopVectorizePass());
+            Fusion.Cleanup.addPass(InstCombinePass());
+            Fusion.Cleanup.addPass(SimplifyCFGPass());
+            FPM.addPass(std::move(Fusion));
+        }else{
+            FPM.addPass(LoopFusionPass());
+        }
+        MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    });
+}
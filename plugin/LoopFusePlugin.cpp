@@ -0,0 +1,29 @@
+#include "llvm/Transforms/Utils/LoopFusePass.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+//"loop-fuse" for -passes and the callbacks of the default pipelines, that a build of LLVM with
+//lib/PassRegistry.def does not get; also used by loop-fuse-batch
+PassPluginLibraryInfo getLoopFusePluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "LoopFuse", LLVM_VERSION_STRING, [](PassBuilder &PB) {
+        PB.registerPipelineParsingCallback(
+            [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+                if (Name != "loop-fuse") {
+                    return false;
+                }
+                FPM.addPass(LoopFusionPass());
+                return true;
+            });
+        registerLoopFusionPassCallbacks(PB);
+    }};
+}
+
+//opt -load-pass-plugin=LoopFusePass.so, clang -fpass-plugin=LoopFusePass.so, ld.lld --load-pass-plugin=LoopFusePass.so
+#ifndef LLVM_LOOPFUSE_LINK_INTO_TOOLS
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return getLoopFusePluginInfo();
+}
+#endif
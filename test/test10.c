@@ -0,0 +1,17 @@
+void f(int *a, int *b, int *c, int *d, int *e, int n) {
+  for (int i=0; i<n; i++) {
+    b[i] = a[i] + 1;
+  }
+
+  for (int i=0; i<n; i++) {
+    c[i] = b[i] * 2;
+  }
+
+  for (int i=0; i<n; i++) {
+    d[i] = c[i] - a[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    e[i] = d[i] + b[i];
+  }
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+void f(int *a, int *b, int *c, int *d, int *e, int n) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    d[i] = a[i] + c[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    e[i] = a[i+1] + c[i] + d[i];
+  }
+}
\ No newline at end of file
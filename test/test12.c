@@ -0,0 +1,11 @@
+void f(int *restrict a, int *restrict b, int *restrict c, int n) {
+  #pragma clang loop unroll_count(4)
+  for (int i=0; i<n; i++) {
+    b[i] = a[i] + 1;
+  }
+
+  #pragma clang loop vectorize_width(8) unroll_count(2)
+  for (int i=0; i<n; i++) {
+    c[i] = b[i] * 2;
+  }
+}
\ No newline at end of file
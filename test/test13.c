@@ -0,0 +1,14 @@
+int f(int *c, int n) {
+  int i = 0;
+  while (i*i < n) {
+    c[i] = 1;
+    i++;
+  }
+
+  int j = 0;
+  while (j*j < 2*n) {
+    c[j] = 2;
+    j++;
+  }
+  return j;
+}
\ No newline at end of file
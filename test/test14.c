@@ -0,0 +1,21 @@
+void f(int *restrict a, int *restrict b, int *restrict c, int n) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i] + 1;
+  }
+
+  int j = 0;
+  do {
+    c[j] = a[j] * 2;
+    j++;
+  } while (j < n);
+
+  int k = 0;
+  do {
+    b[k] = c[k];
+    k++;
+  } while (k < n);
+
+  for (int l=0; l<n; l++) {
+    a[l] = b[l] + c[l];
+  }
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+void f(int *restrict a, int *restrict b, int n) {
+  for (int i=0; i<n; i++) {
+    for (int j=0; j<65; j++) {
+      a[i*64+j] = i + j;
+    }
+  }
+
+  for (int i=0; i<n; i++) {
+    for (int j=0; j<65; j++) {
+      b[i*64+j] = a[i*64+j] * 2;
+    }
+  }
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#include <stdio.h>
+
+void f(int *a, int *b, int *c, int n) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i] + i;
+  }
+
+  for (int i=0; i<n; i++) {
+    c[i] = b[i] - 1;
+  }
+}
+
+int main(void) {
+  int x[101];
+  for (int i=0; i<101; i++) {
+    x[i] = i;
+  }
+
+  f(x + 1, x, x + 2, 99);
+
+  unsigned sum = 0;
+  for (int i=0; i<101; i++) {
+    sum = sum * 31 + x[i];
+  }
+  printf("%u\n", sum);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+void f(int *a, int *b, int *c, int n) {
+  int i = 0;
+  do {
+    a[i] = b[i] + i;
+    i++;
+  } while (i < n);
+
+  int j = 0;
+  do {
+    c[j] = b[j] - 1;
+    j++;
+  } while (j < n);
+}
+
+int main(void) {
+  int x[100];
+  int y[50];
+  for (int i=0; i<100; i++) {
+    x[i] = i;
+  }
+
+  f(x, x + 49, y, 50);
+
+  unsigned sum = 0;
+  for (int i=0; i<50; i++) {
+    sum = sum * 31 + x[i] + y[i];
+  }
+  printf("%u\n", sum);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+void f(int *restrict b, int *restrict c, int *restrict d, int n) {
+  int t[100];
+  for (int i=0; i<n; i++) {
+    if (b[i] > 0)
+      t[i] = b[i];
+    else
+      t[i] = c[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    d[i] = t[i] * 2;
+  }
+}
\ No newline at end of file
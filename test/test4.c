@@ -0,0 +1,13 @@
+void f(int * restrict a, int * restrict b, int * restrict c, int * restrict d, int n) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i] + c[i];
+  }
+
+  int k = n * 3;
+  d[0] = k;
+  d[1] = a[0];
+
+  for (int i=0; i<n; i++) {
+    c[i] = a[i] + k;
+  }
+}
\ No newline at end of file
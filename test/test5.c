@@ -0,0 +1,39 @@
+#include <stdio.h>
+
+void f(int a[restrict][64], int b[restrict][64], int c[restrict][64], int n) {
+  for (int i=0; i<n; i++) {
+    for (int j=0; j<64; j++) {
+      a[i][j] = b[i][j] + c[i][j];
+    }
+  }
+
+  for (int i=0; i<n; i++) {
+    for (int j=0; j<64; j++) {
+      c[i][j] = a[i][j] * 2;
+    }
+  }
+}
+
+int main(void) {
+  int a[10][64], b[10][64], c[10][64];
+  for (int i=0; i<10; i++) {
+    for (int j=0; j<64; j++) {
+      a[i][j] = i * 64 + j;
+      b[i][j] = (i * 64 + j) * 3;
+      c[i][j] = (i * 64 + j) ^ 5;
+    }
+  }
+
+  unsigned sum = 0;
+  int sizes[] = {10, 3, 1, 0};
+  for (int k=0; k<4; k++) {
+    f(a, b, c, sizes[k]);
+    for (int i=0; i<10; i++) {
+      for (int j=0; j<64; j++) {
+        sum = sum * 31 + a[i][j] + c[i][j];
+      }
+    }
+  }
+  printf("%u\n", sum);
+  return 0;
+}
\ No newline at end of file
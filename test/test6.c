@@ -0,0 +1,13 @@
+void f(int *a, int *b, int *c, int n, int k) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    b[i] = a[i+k] * 2;
+  }
+
+  for (int i=0; i<n; i++) {
+    c[i] = b[i+k];
+  }
+}
\ No newline at end of file
@@ -0,0 +1,11 @@
+void f(int *b, int *c, int *d, int n) {
+  int t[1024];
+
+  for (int i=0; i<n; i++) {
+    t[i] = b[i] + c[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    d[i] = t[i] * 2;
+  }
+}
\ No newline at end of file
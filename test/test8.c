@@ -0,0 +1,33 @@
+#include <stdio.h>
+
+void f(int *restrict a, int *restrict b, int *restrict c, int n) {
+  for (int i=0; i<n; i++) {
+    a[i] = b[i] * 2;
+  }
+
+  for (int i=0; i<n; i++) {
+    c[i] = a[i+1] + a[i+2];
+  }
+}
+
+int main(void) {
+  int a[102], b[100], c[100];
+  for (int i=0; i<102; i++) {
+    a[i] = i * 7;
+  }
+  for (int i=0; i<100; i++) {
+    b[i] = i * 3 + 1;
+    c[i] = 0;
+  }
+
+  unsigned sum = 0;
+  int sizes[] = {100, 7, 2, 1, 0};
+  for (int k=0; k<5; k++) {
+    f(a, b, c, sizes[k]);
+    for (int i=0; i<100; i++) {
+      sum = sum * 31 + a[i] + c[i];
+    }
+  }
+  printf("%u\n", sum);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+int f(int *a, int *b, int *c, int n) {
+  for (int i=1; i<n; i+=2) {
+    if (b[i] == 0)
+      continue;
+    a[i] = b[i] * 2;
+  }
+
+  int s = 0;
+  for (int k=1; k<n; k+=2) {
+    if (a[k] < 0)
+      continue;
+    s += a[k];
+    c[k] = s;
+  }
+  return s;
+}
\ No newline at end of file
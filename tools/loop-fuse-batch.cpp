@@ -0,0 +1,317 @@
+//loop-fuse-batch: runs a pass pipeline (by default just loop-fuse) over many IR modules in
+//parallel and writes the optimized modules and the fusion stats of the whole batch.
+//
+//  loop-fuse-batch -o out/ -j 16 a.bc b.bc dir/c.ll ...   (or @list with one module per line)
+//
+//Every module is parsed in its own LLVMContext and optimized by a worker of a thread pool;
+//out/<path of the module> gets the result, in the format of the input (.ll text, else bitcode).
+//The stats are counted from the remarks of the pass, so unlike -stats they do not need a
+//build of LLVM with statistics enabled.
+#include "llvm/Transforms/Utils/LoopFusePass.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+
+using namespace llvm;
+
+//plugin/LoopFusePlugin.cpp, linked in
+PassPluginLibraryInfo getLoopFusePluginInfo();
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore, cl::desc("<input modules>"));
+
+static cl::opt<std::string> OutputDirectory("o", cl::Required, cl::desc("Directory of the optimized modules"),
+                                            cl::value_desc("directory"));
+
+static cl::opt<unsigned> Jobs("j", cl::init(0), cl::desc("Number of worker threads (default: all the cores)"));
+
+static cl::opt<std::string> Passes("passes", cl::init("loop-fuse"),
+                                   cl::desc("Pipeline run on every module, as in opt -passes (default: loop-fuse)"));
+
+static cl::opt<std::string> StatsFile("stats-file", cl::desc("JSON file of the stats (default: <directory>/loop-fuse-stats.json)"),
+                                      cl::value_desc("filename"));
+
+//remark counts, ordered so that the stats of two runs can be diffed
+typedef std::map<std::string, unsigned> remarkCounts;
+
+//what happened to a module: the remarks of loop-fuse, by name for the transformations and by
+//reason for the missed fusions
+struct moduleResult{
+    bool failed = false;
+    std::string error;
+    remarkCounts passed;
+    remarkCounts missed;
+};
+
+//counts the remarks of loop-fuse and records the errors in the result, so that a broken module fails
+//without stopping the batch; the other diagnostics go to the default handler
+struct fusionRemarkCounter : public DiagnosticHandler {
+    moduleResult &result;
+
+    fusionRemarkCounter(moduleResult &result) : result(result) {}
+
+    bool isAnalysisRemarkEnabled(StringRef PassName) const override { return false; }
+    bool isMissedOptRemarkEnabled(StringRef PassName) const override { return PassName == "loop-fuse"; }
+    bool isPassedOptRemarkEnabled(StringRef PassName) const override { return PassName == "loop-fuse"; }
+    bool isAnyRemarkEnabled() const override { return true; }
+
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        if (DI.getSeverity() == DS_Error) {
+            raw_string_ostream errors(result.error);
+            DiagnosticPrinterRawOStream printer(errors);
+            DI.print(printer);
+            errors << "\n";
+            result.failed = true;
+            return true;
+        }
+        auto *remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+        if (!remark || remark->getPassName() != "loop-fuse") {
+            return false;
+        }
+        if (remark->getKind() == DK_OptimizationRemark) {
+            ++result.passed[remark->getRemarkName().str()];
+        }
+        else if (remark->getKind() == DK_OptimizationRemarkMissed) {
+            //reportMissedFusion puts the cause in "Reason", the other missed remarks only have a name
+            StringRef reason = remark->getRemarkName();
+            for (const DiagnosticInfoOptimizationBase::Argument &Arg : remark->getArgs()) {
+                if (Arg.Key == "Reason") {
+                    reason = Arg.Val;
+                }
+            }
+            ++result.missed[reason.str()];
+        }
+        return true;
+    }
+};
+
+//out/<path of the input without its root>, so that inputs with the same name in different directories do not collide;
+//empty if the .. of the path climb out of the directory
+static std::string getOutputPath(StringRef Input) {
+    SmallString<256> relative(sys::path::relative_path(Input));
+    sys::path::remove_dots(relative, true);
+    if (relative.empty() || *sys::path::begin(relative) == "..") {
+        return "";
+    }
+    SmallString<256> path(OutputDirectory);
+    sys::path::append(path, relative);
+    return std::string(path);
+}
+
+//the target of the module, for the cost models of the pass and of the pipeline; null if it is not linked in
+static std::unique_ptr<TargetMachine> createTargetMachine(Module &M) {
+    std::string error;
+    const Target *T = TargetRegistry::lookupTarget(M.getTargetTriple(), error);
+    if (!T) {
+        return nullptr;
+    }
+    return std::unique_ptr<TargetMachine>(
+        T->createTargetMachine(M.getTargetTriple(), "", "", TargetOptions(), std::nullopt));
+}
+
+static void optimizeModule(StringRef Input, const std::string &output, moduleResult &result) {
+    LLVMContext Ctx;
+    Ctx.setDiagnosticHandler(std::make_unique<fusionRemarkCounter>(result));
+
+    raw_string_ostream errors(result.error);
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M = parseIRFile(Input, Err, Ctx);
+    if (!M) {
+        Err.print("loop-fuse-batch", errors, false);
+        result.failed = true;
+        return;
+    }
+
+    std::unique_ptr<TargetMachine> TM = createTargetMachine(*M);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM.get());
+    getLoopFusePluginInfo().RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (Error E = PB.parsePassPipeline(MPM, Passes)) {
+        errors << toString(std::move(E)) << "\n";
+        result.failed = true;
+        return;
+    }
+    MPM.run(*M, MAM);
+    if (result.failed) {
+        return;
+    }
+
+    if (verifyModule(*M, &errors)) {
+        errors << Input << ": the optimized module is broken\n";
+        result.failed = true;
+        return;
+    }
+
+    std::error_code EC = sys::fs::create_directories(sys::path::parent_path(output));
+    bool text = Input.endswith(".ll");
+    ToolOutputFile Out(output, EC, text ? sys::fs::OF_TextWithCRLF : sys::fs::OF_None);
+    if (EC) {
+        errors << output << ": " << EC.message() << "\n";
+        result.failed = true;
+        return;
+    }
+    if (text) {
+        M->print(Out.os(), nullptr);
+    }
+    else {
+        WriteBitcodeToFile(*M, Out.os());
+    }
+    Out.keep();
+}
+
+static void addCounts(remarkCounts &total, const remarkCounts &counts) {
+    for (const auto &entry : counts) {
+        total[entry.first] += entry.second;
+    }
+}
+
+static void writeCounts(json::OStream &J, StringRef Name, const remarkCounts &counts) {
+    J.attributeObject(Name, [&] {
+        for (const auto &entry : counts) {
+            J.attribute(entry.first, entry.second);
+        }
+    });
+}
+
+static unsigned getCount(const remarkCounts &counts, const std::string &Name) {
+    auto it = counts.find(Name);
+    return it == counts.end() ? 0 : it->second;
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    cl::ParseCommandLineOptions(argc, argv, "loop-fuse on many modules in parallel\n");
+
+    std::vector<moduleResult> results(InputFiles.size());
+
+    //the outputs are chosen before the workers start: a module that would be written out of the directory,
+    //over the output of another module or over an input fails without being optimized
+    std::set<sys::fs::UniqueID> inputIDs;
+    for (const std::string &input : InputFiles) {
+        sys::fs::UniqueID ID;
+        if (!sys::fs::getUniqueID(input, ID)) {
+            inputIDs.insert(ID);
+        }
+    }
+    std::vector<std::string> outputs(InputFiles.size());
+    std::map<std::string, size_t> owners;
+    for (size_t i = 0; i < InputFiles.size(); i++) {
+        outputs[i] = getOutputPath(InputFiles[i]);
+        raw_string_ostream errors(results[i].error);
+        sys::fs::UniqueID ID;
+        if (outputs[i].empty()) {
+            errors << InputFiles[i] << ": the output would be out of " << OutputDirectory << "\n";
+        }
+        else if (!owners.insert({outputs[i], i}).second) {
+            errors << outputs[i] << ": already the output of " << InputFiles[owners[outputs[i]]] << "\n";
+        }
+        else if (!sys::fs::getUniqueID(outputs[i], ID) && inputIDs.count(ID)) {
+            errors << outputs[i] << ": the output would overwrite an input module\n";
+        }
+        else {
+            continue;
+        }
+        results[i].failed = true;
+    }
+
+    std::atomic<unsigned> done(0);
+    std::mutex progress;
+    ThreadPool Pool(hardware_concurrency(Jobs));
+    for (size_t i = 0; i < InputFiles.size(); i++) {
+        Pool.async([&, i] {
+            if (!results[i].failed) {
+                optimizeModule(InputFiles[i], outputs[i], results[i]);
+            }
+            unsigned count = ++done;
+            if (results[i].failed) {
+                std::lock_guard<std::mutex> lock(progress);
+                errs() << "[" << count << "/" << InputFiles.size() << "] " << InputFiles[i] << ": failed\n"
+                       << results[i].error;
+            }
+        });
+    }
+    Pool.wait();
+
+    //totals, and the modules in the order of the command line whatever the order they finished in
+    remarkCounts passed, missed;
+    unsigned failed = 0, transformed = 0;
+    for (moduleResult &result : results) {
+        failed += result.failed;
+        transformed += getCount(result.passed, "Fused") > 0;
+        addCounts(passed, result.passed);
+        addCounts(missed, result.missed);
+    }
+
+    std::string statsPath = StatsFile.empty() ? getOutputPath("loop-fuse-stats.json") : std::string(StatsFile);
+    std::error_code EC;
+    ToolOutputFile Stats(statsPath, EC, sys::fs::OF_TextWithCRLF);
+    if (EC) {
+        errs() << statsPath << ": " << EC.message() << "\n";
+        return 1;
+    }
+    {
+        json::OStream J(Stats.os(), 2);
+        J.object([&] {
+            J.attribute("modules", (int64_t)results.size());
+            J.attribute("failed", failed);
+            J.attribute("transformed", transformed);
+            writeCounts(J, "passed", passed);
+            writeCounts(J, "missed", missed);
+            J.attributeArray("files", [&] {
+                for (size_t i = 0; i < results.size(); i++) {
+                    J.object([&] {
+                        J.attribute("file", InputFiles[i]);
+                        J.attribute("failed", results[i].failed);
+                        writeCounts(J, "passed", results[i].passed);
+                        writeCounts(J, "missed", results[i].missed);
+                    });
+                }
+            });
+        });
+    }
+    Stats.os() << "\n";
+    Stats.keep();
+
+    outs() << results.size() << " modules, " << failed << " failed, " << transformed << " with fused loops\n";
+    outs() << getCount(passed, "Fused") << " loops fused";
+    for (const char *name : {"Peeled", "Shifted", "Versioned", "Forwarded", "Contracted"}) {
+        outs() << ", " << getCount(passed, name) << " " << StringRef(name).lower();
+    }
+    outs() << "\n";
+    for (const auto &entry : missed) {
+        outs() << "  not fused, " << entry.first << ": " << entry.second << "\n";
+    }
+    outs() << "stats in " << statsPath << "\n";
+    return failed ? 1 : 0;
+}